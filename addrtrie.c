@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A path-compressed binary trie per address family, holding the CIDR
+ * entries of any number of address lists. Each prefix node records which
+ * lists name it (and whether negated), so a single walk down the trie for
+ * an address yields its result against every list at once.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "addrtrie.h"
+
+struct addr_trie_ent {
+	u_int	 id;		/* of the list, see addr_trie_add_list() */
+	int	 neg;
+};
+
+struct addr_trie_node {
+	u_char	 key[16];
+	u_int	 bits;		/* prefix length of key */
+	struct addr_trie_node *child[2];
+	u_int	 nent;		/* 0 for internal nodes */
+	struct addr_trie_ent *ent;
+};
+
+#define ADDR_TRIE_BIT(key, n)	(((key)[(n) / 8] >> (7 - ((n) % 8))) & 1)
+
+/* Length of the common prefix of a and b, up to max bits */
+static u_int
+addr_trie_common(const u_char *a, const u_char *b, u_int max)
+{
+	u_int i = 0;
+	u_char x;
+
+	while (i < max && a[i / 8] == b[i / 8])
+		i += 8;
+	if (i < max)
+		for (x = a[i / 8] ^ b[i / 8]; (x & 0x80) == 0; x <<= 1)
+			i++;
+	return MIN(i, max);
+}
+
+/*
+ * Parse a numeric address into key, returning its family or -1.
+ * Deliberately stricter than addr_pton(): anything refused here is
+ * handled by addr_match_list() instead.
+ */
+int
+addr_trie_pton(const char *s, u_char *key)
+{
+	memset(key, 0, 16);
+	if (inet_pton(AF_INET, s, key) == 1)
+		return AF_INET;
+	if (inet_pton(AF_INET6, s, key) == 1)
+		return AF_INET6;
+	return -1;
+}
+
+/* Parse a CIDR list entry. Returns its family or -1 */
+static int
+addr_trie_cidr(const char *s, u_char *key, u_int *bitsp)
+{
+	char buf[INET6_ADDRSTRLEN + 5], *sp, *ep;
+	u_long bits;
+	u_int i, max;
+	int af;
+
+	if (strlcpy(buf, s, sizeof(buf)) >= sizeof(buf))
+		return -1;
+	if ((sp = strchr(buf, '/')) != NULL) {
+		*sp++ = '\0';
+		if (!isdigit((u_char)*sp))
+			return -1;
+		bits = strtoul(sp, &ep, 10);
+		if (*ep != '\0')
+			return -1;
+	}
+	if ((af = addr_trie_pton(buf, key)) == -1)
+		return -1;
+	max = af == AF_INET ? 32 : 128;
+	if (sp == NULL)
+		bits = max;
+	else if (bits > max)
+		return -1;
+	/* addr_match_list() rejects entries with host bits set */
+	for (i = bits; i < max; i++)
+		if (ADDR_TRIE_BIT(key, i))
+			return -1;
+	*bitsp = bits;
+	return af;
+}
+
+static struct addr_trie_node *
+addr_trie_node_new(const u_char *key, u_int bits)
+{
+	struct addr_trie_node *n;
+
+	n = xcalloc(1, sizeof(*n));
+	memcpy(n->key, key, sizeof(n->key));
+	n->bits = bits;
+	return n;
+}
+
+/* Find or create the node for a prefix */
+static struct addr_trie_node *
+addr_trie_insert(struct addr_trie_node **np, const u_char *key, u_int bits)
+{
+	struct addr_trie_node *n, *new, *glue;
+	u_int common;
+
+	while ((n = *np) != NULL) {
+		common = addr_trie_common(n->key, key, MIN(n->bits, bits));
+		if (common == n->bits) {
+			if (n->bits == bits)
+				return n;
+			np = &n->child[ADDR_TRIE_BIT(key, n->bits)];
+			continue;
+		}
+		/* The new prefix diverges from, or contains, this node */
+		new = addr_trie_node_new(key, bits);
+		if (common == bits) {
+			new->child[ADDR_TRIE_BIT(n->key, bits)] = n;
+			*np = new;
+		} else {
+			glue = addr_trie_node_new(key, common);
+			memset(glue->key, 0, sizeof(glue->key));
+			memcpy(glue->key, key, common / 8);
+			if (common % 8 != 0)
+				glue->key[common / 8] = key[common / 8] &
+				    (0xff << (8 - common % 8));
+			glue->child[ADDR_TRIE_BIT(key, common)] = new;
+			glue->child[ADDR_TRIE_BIT(n->key, common)] = n;
+			*np = glue;
+		}
+		return new;
+	}
+	return (*np = addr_trie_node_new(key, bits));
+}
+
+static void
+addr_trie_node_free(struct addr_trie_node *n)
+{
+	if (n == NULL)
+		return;
+	addr_trie_node_free(n->child[0]);
+	addr_trie_node_free(n->child[1]);
+	free(n->ent);
+	free(n);
+}
+
+void
+addr_trie_free(struct addr_trie *t)
+{
+	addr_trie_node_free(t->root4);
+	addr_trie_node_free(t->root6);
+	t->root4 = t->root6 = NULL;
+}
+
+/*
+ * Add the entries of a Match address list to the trie under the given id.
+ * Returns 0 on success, or -1 if the list has entries the trie cannot
+ * represent; the trie may then hold unreachable entries for this id.
+ */
+int
+addr_trie_add_list(struct addr_trie *t, const char *list, u_int id)
+{
+	struct addr_trie_node *n;
+	char *cp, *o, *entry;
+	u_char key[16];
+	u_int bits;
+	int af, neg, r = 0;
+
+	o = cp = xstrdup(list);
+	while ((entry = strsep(&cp, ",")) != NULL) {
+		if ((neg = *entry == '!'))
+			entry++;
+		if ((af = addr_trie_cidr(entry, key, &bits)) == -1) {
+			r = -1;
+			break;
+		}
+		n = addr_trie_insert(af == AF_INET ? &t->root4 : &t->root6,
+		    key, bits);
+		n->ent = xrealloc(n->ent, n->nent + 1, sizeof(*n->ent));
+		n->ent[n->nent].id = id;
+		n->ent[n->nent].neg = neg;
+		n->nent++;
+	}
+	free(o);
+	return r;
+}
+
+/* Walk the trie for an address, flagging each criterion it falls under */
+void
+addr_trie_lookup(struct addr_trie *t, int af, const u_char *key,
+    u_char *hits)
+{
+	struct addr_trie_node *n;
+	u_int i, max = af == AF_INET ? 32 : 128;
+
+	n = af == AF_INET ? t->root4 : t->root6;
+	while (n != NULL && addr_trie_common(n->key, key, n->bits) == n->bits) {
+		for (i = 0; i < n->nent; i++)
+			hits[n->ent[i].id] |= n->ent[i].neg ?
+			    ADDR_TRIE_NEG : ADDR_TRIE_HIT;
+		if (n->bits >= max)
+			break;
+		n = n->child[ADDR_TRIE_BIT(key, n->bits)];
+	}
+}
+
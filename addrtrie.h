@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _ADDRTRIE_H
+#define _ADDRTRIE_H
+
+#define ADDR_TRIE_HIT	0x01	/* address is in a listed prefix */
+#define ADDR_TRIE_NEG	0x02	/* address is in a negated prefix */
+
+struct addr_trie_node;
+
+struct addr_trie {
+	struct addr_trie_node *root4;
+	struct addr_trie_node *root6;
+};
+
+int	 addr_trie_pton(const char *, u_char *);
+void	 addr_trie_free(struct addr_trie *);
+int	 addr_trie_add_list(struct addr_trie *, const char *, u_int);
+void	 addr_trie_lookup(struct addr_trie *, int, const u_char *, u_char *);
+
+#endif /* _ADDRTRIE_H */
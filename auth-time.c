@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The monitor requests of the authentication time detector (see auth2.c).
+ * The per-source records are kept in a file that only the monitor can
+ * write, so under privilege separation the unprivileged child asks the
+ * monitor to update the record of its peer. The monitor uses the address
+ * it sees itself, so a compromised child can at worst mislead the record
+ * of its own source. The counts of the actions taken on attempts judged
+ * an attack are likewise kept by the monitor.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "buffer.h"
+#include "log.h"
+#include "key.h"
+#include "hostfile.h"
+#include "auth.h"
+#include "canohost.h"
+#include "servconf.h"
+#include "monitor.h"
+#include "monitor_wrap.h"
+
+extern struct monitor *pmonitor;
+
+/* Client side, in the unprivileged child: see auth_source_update() */
+int
+mm_auth_source_update(double authtime, struct auth_source_stats *prev)
+{
+	Buffer m;
+	u_char *p;
+	u_int len;
+	int r;
+
+	debug3("%s entering", __func__);
+
+	buffer_init(&m);
+	buffer_put_string(&m, &authtime, sizeof(authtime));
+	mm_request_send(pmonitor->m_recvfd, MONITOR_REQ_AUTHSOURCE, &m);
+
+	debug3("%s: waiting for MONITOR_ANS_AUTHSOURCE", __func__);
+	mm_request_receive_expect(pmonitor->m_recvfd, MONITOR_ANS_AUTHSOURCE,
+	    &m);
+
+	r = buffer_get_int(&m);
+	p = buffer_get_string(&m, &len);
+	if (len != sizeof(*prev))
+		fatal("%s: struct auth_source_stats size mismatch", __func__);
+	memcpy(prev, p, sizeof(*prev));
+	free(p);
+	buffer_free(&m);
+
+	return (r);
+}
+
+/* Monitor side: update the record of the peer's address */
+int
+mm_answer_auth_source(int sock, Buffer *m)
+{
+	struct auth_source_stats prev;
+	double authtime;
+	u_char *p;
+	u_int len;
+	int r;
+
+	p = buffer_get_string(m, &len);
+	if (len != sizeof(authtime))
+		fatal("%s: bad authentication time", __func__);
+	memcpy(&authtime, p, sizeof(authtime));
+	free(p);
+
+	/* auth_source_update() rejects times the child could not measure */
+	r = auth_source_update(get_remote_ipaddr(), authtime, &prev);
+	debug3("%s: %s %.6f: %d", __func__, get_remote_ipaddr(), authtime, r);
+
+	buffer_clear(m);
+	buffer_put_int(m, r);
+	buffer_put_string(m, &prev, sizeof(prev));
+	mm_request_send(sock, MONITOR_ANS_AUTHSOURCE, m);
+
+	return (0);
+}
+
+/* Client side: see auth_attack_count(). The monitor sends no answer */
+void
+mm_auth_attack_count(u_int action)
+{
+	Buffer m;
+
+	debug3("%s entering", __func__);
+
+	buffer_init(&m);
+	buffer_put_int(&m, action);
+	mm_request_send(pmonitor->m_recvfd, MONITOR_REQ_AUTHACTION, &m);
+	buffer_free(&m);
+}
+
+int
+mm_answer_auth_action(int sock, Buffer *m)
+{
+	u_int action;
+
+	/* auth_attack_count() ignores actions it does not know */
+	action = buffer_get_int(m);
+	debug3("%s: action %u", __func__, action);
+	auth_attack_count(action);
+
+	return (0);
+}
@@ -29,8 +29,12 @@
 #include <sys/stat.h>
 #include <sys/uio.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
@@ -100,6 +104,7 @@ static void input_userauth_request(int, u_int32_t, void *);
 /* helper */
 static Authmethod *authmethod_lookup(Authctxt *, const char *);
 static char *authmethods_get(Authctxt *authctxt);
+static void userauth_send_failure(Authctxt *, int, int);
 
 #define MATCH_NONE	0	/* method or submethod mismatch */
 #define MATCH_METHOD	1	/* method matches (no submethod specified) */
@@ -107,22 +112,412 @@ static char *authmethods_get(Authctxt *authctxt);
 #define MATCH_PARTIAL	3	/* method matches, submethod can't be checked */
 static int list_starts_with(const char *, const char *, const char *);
 
-struct timeval s; //パスワード入力開始時間を格納
-struct timeval s2; //1コネクションで複数回の試行があった場合はこの変数に開始時間を格納
-int MULTIPLE_AUTH = 0;
-char *USER; //AuthInfoのユーザ名用変数
 double AuthTimeThreshold;
 
+/*
+ * Timeline of the authentication exchange, stamped from the monotonic
+ * clock in nanoseconds so that adjustments to the time of day do not
+ * disturb it.  A password attempt is timed from the later of the
+ * SERVICE_ACCEPT and the failure reply to the previous "none" or
+ * password attempt, up to the end of its verification.  Each Authctxt
+ * has its own, allocated when first used and kept as long as the context
+ * (auth.h declares it only as a pointer).
+ */
+enum auth_tl_event {
+	AUTH_TL_SERVICE_ACCEPT,	/* SERVICE_ACCEPT sent */
+	AUTH_TL_REQUEST,	/* USERAUTH_REQUEST received */
+	AUTH_TL_DISPATCH,	/* method handler called */
+	AUTH_TL_VERIFIED,	/* method reached userauth_finish() */
+	AUTH_TL_MAX
+};
+
+struct auth_timeline {
+	u_int64_t	 stamp[AUTH_TL_MAX];
+	u_int64_t	 start;			/* current attempt timed from */
+	u_int64_t	 end;			/* and to, once classified */
+	int		 classified;
+	int		 attack;
+	u_int		 nflagged;		/* attempts judged an attack */
+	double		 held;			/* secs tarpitted in all */
+	double		 pad;			/* secs to hold a rejection */
+	volatile sig_atomic_t stop;		/* dispatch_run() to return */
+	int		 holding;		/* failure reply held back */
+	u_int64_t	 release;		/* until */
+	int		 held_partial;		/* and what to send then */
+	int		 held_restart;
+	double		 kexinit;		/* KEX round trips, secs */
+	double		 newkeys;
+};
+
 //#define HPING_BUF 256
 //char HPING_RTT[10];
 //double HPING_RTT_DOUBLE;
 
-//鍵交換時のRTTが格納される変数
+/*
+ * Round trips measured during key exchange; the timeline takes a copy once
+ * the first exchange is complete.
+ */
 double KEXINIT_TIME;
 extern double KEXINIT_TIME;
 double NEWKEYS_TIME;
 extern double NEWKEYS_TIME;
 
+static struct auth_timeline *
+auth_timeline(Authctxt *authctxt)
+{
+	if (authctxt->timeline == NULL)
+		authctxt->timeline = xcalloc(1, sizeof(*authctxt->timeline));
+	return authctxt->timeline;
+}
+
+static void
+auth_timeline_mark(Authctxt *authctxt, enum auth_tl_event ev)
+{
+	auth_timeline(authctxt)->stamp[ev] = monotime_nsec();
+}
+
+/* Start timing the next attempt from now */
+static void
+auth_timeline_restart(Authctxt *authctxt)
+{
+	struct auth_timeline *tl = auth_timeline(authctxt);
+
+	tl->start = monotime_nsec();
+	tl->classified = 0;
+}
+
+/* Seconds between two events, or 0 if either is missing */
+static double
+auth_timeline_span(u_int64_t from, u_int64_t to)
+{
+	if (from == 0 || to < from)
+		return 0.0;
+	return (to - from) / 1e9;
+}
+
+/*
+ * With AuthTimeDetection adaptive, a source is also judged against its
+ * own record once it has one: an attempt much faster than is usual for
+ * it, or a source making attempts faster than anyone types, is an attack.
+ */
+#define AUTH_SOURCE_MINSAMPLES	4	/* before a record is used */
+#define AUTH_SOURCE_DEVIATIONS	3.0	/* below the mean that is suspect */
+#define AUTH_SOURCE_MAXRATE	1.0	/* attempts per second */
+
+/*
+ * Returns 1 if an attempt of authtime seconds looks automated. With
+ * AuthTimeDetection rtt, AuthTimeRTTFactor round trips are first taken off
+ * the attempt time, though not below AuthTimeRTTFloor, so that the time
+ * the client spent is judged rather than the time the network took. The
+ * record of the source is only consulted, and updated with the attempt,
+ * if update is set; otherwise the threshold alone decides.
+ */
+static int
+auth_detect_attack(struct auth_timeline *tl, double authtime, int update)
+{
+	struct auth_source_stats prev;
+	int r, attack = authtime < AuthTimeThreshold;
+	double d, t;
+
+	if (options.auth_time_detection == AUTH_TIME_DETECT_RTT) {
+		t = authtime - options.auth_time_rtt_factor *
+		    (tl->kexinit + tl->newkeys) / 2;
+		if (t < options.auth_time_rtt_floor)
+			t = options.auth_time_rtt_floor;
+		debug3("%s: %.6f seconds less round trips", __func__, t);
+		return t < AuthTimeThreshold;
+	}
+	if (options.auth_time_detection != AUTH_TIME_DETECT_ADAPTIVE ||
+	    !update)
+		return attack;
+	/* Only the monitor may update the record, for the peer it sees */
+	if (use_privsep)
+		r = mm_auth_source_update(authtime, &prev);
+	else
+		r = auth_source_update(get_remote_ipaddr(), authtime, &prev);
+	if (r != 0)
+		return attack;
+	debug3("%s: source mean %.6f var %.6f rate %.3f samples %u",
+	    __func__, prev.mean, prev.var, prev.rate, prev.samples);
+	if (attack || prev.samples < AUTH_SOURCE_MINSAMPLES)
+		return attack;
+	if (prev.rate > AUTH_SOURCE_MAXRATE)
+		return 1;
+	d = prev.mean - authtime;
+	return d > 0 &&
+	    d * d > AUTH_SOURCE_DEVIATIONS * AUTH_SOURCE_DEVIATIONS * prev.var;
+}
+
+/*
+ * Classify the current attempt as timed up to end, unless that has been
+ * done already, updating the record of its source if update is set.
+ * Returns 1 if it looks automated.
+ */
+static int
+auth_detect_classify(Authctxt *authctxt, u_int64_t end, int update)
+{
+	struct auth_timeline *tl = auth_timeline(authctxt);
+
+	if (!tl->classified) {
+		tl->end = end;
+		tl->attack = auth_detect_attack(tl,
+		    auth_timeline_span(tl->start, end), update);
+		tl->classified = 1;
+		if (tl->attack) {
+			tl->nflagged++;
+			PRIVSEP(auth_attack_count(AUTH_ACT_FLAGGED));
+		}
+	}
+	return tl->attack;
+}
+
+/*
+ * Log a completed password attempt for the detector, classifying it by
+ * how long the client took over it if that was not done on its arrival.
+ * Only a failed attempt updates the record of its source: once the reply
+ * to a successful one has been sent, the monitor has left
+ * pre-authentication and would take a request as a protocol violation.
+ */
+static void
+auth_detect_log(Authctxt *authctxt, int authenticated)
+{
+	struct auth_timeline *tl = auth_timeline(authctxt);
+	struct timeval now;
+	struct tm *tm;
+	double authtime;
+	const char *detection;
+
+	detection = auth_detect_classify(authctxt,
+	    tl->stamp[AUTH_TL_VERIFIED], !authenticated) ? "Attack" : "Normal";
+	authtime = auth_timeline_span(tl->start, tl->end);
+	debug("%s: attempt %.9f request %.9f dispatch %.9f verify %.9f",
+	    __func__, authtime,
+	    auth_timeline_span(tl->start, tl->stamp[AUTH_TL_REQUEST]),
+	    auth_timeline_span(tl->stamp[AUTH_TL_REQUEST],
+	    tl->stamp[AUTH_TL_DISPATCH]),
+	    auth_timeline_span(tl->stamp[AUTH_TL_DISPATCH],
+	    tl->stamp[AUTH_TL_VERIFIED]));
+
+	/* The date is for the log only */
+	gettimeofday(&now, NULL);
+	tm = localtime(&now.tv_sec);
+	logit("[Auth:%s,User:%s,IP:%s,Time:%lf,Detect:%s,RTT:%06lf,"
+	    "Year:%d,Month:%02d,Day:%02d,Hour:%02d,Minute:%02d,Second:%02d,"
+	    "MicroSec:%06d]KEXINIT:%lf,NEWKEYS:%lf",
+	    authenticated ? "Success" : "Fail", authctxt->user,
+	    get_remote_ipaddr(), authtime, detection,
+	    (tl->kexinit + tl->newkeys) / 2,
+	    tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+	    tm->tm_hour, tm->tm_min, tm->tm_sec, (int)now.tv_usec,
+	    tl->kexinit, tl->newkeys);
+}
+
+/*
+ * With an AuthTimeAttackPolicy, password attempts are classified as soon
+ * as they arrive, so that the policy can act on one judged an attack
+ * before the costly verification: delay it, or reject it without
+ * verifying. Without one, they are classified once verified, the time
+ * taken included, as the threshold was set for. A rejected attempt gets
+ * the same failure reply as a wrong password, after as long as verifying
+ * a wrong password has been taking, so that neither tells the client it
+ * was caught. That time is measured on the connection: until a wrong
+ * password has been verified, an attempt judged an attack is verified
+ * like any other, and seeds it. Returns -1 if the attempt is to be
+ * rejected.
+ */
+#define AUTH_VERIFY_WEIGHT	0.25	/* of a new failure in the average */
+
+static double auth_verify_time = 0.0;
+static int auth_verify_timed = 0;
+
+/*
+ * Sleep for secs seconds, whatever signals arrive. Only AuthTimeAttackDelay
+ * is spent this way, as the attempt is verified after it.
+ */
+static void
+auth_attack_sleep(double secs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static int
+auth_attack_policy(Authctxt *authctxt, const char *method)
+{
+	struct auth_timeline *tl = auth_timeline(authctxt);
+
+	if (options.auth_time_attack_policy == AUTH_ATTACK_NONE ||
+	    strcmp(method, "password") != 0 ||
+	    !auth_detect_classify(authctxt, tl->stamp[AUTH_TL_REQUEST], 1))
+		return 0;
+	switch (options.auth_time_attack_policy) {
+	case AUTH_ATTACK_DELAY:
+		debug("%s: delaying attempt %.3f seconds", __func__,
+		    options.auth_time_attack_delay);
+		PRIVSEP(auth_attack_count(AUTH_ACT_DELAYED));
+		auth_attack_sleep(options.auth_time_attack_delay);
+		break;
+	case AUTH_ATTACK_REJECT:
+		if (!auth_verify_timed) {
+			debug("%s: verifying attempt, as no wrong password "
+			    "has been timed yet", __func__);
+			break;
+		}
+		debug("%s: rejecting attempt unverified after %.3f seconds",
+		    __func__, auth_verify_time);
+		PRIVSEP(auth_attack_count(AUTH_ACT_REJECTED));
+		/* auth_attack_respond() holds the reply that long */
+		tl->pad = auth_verify_time;
+		return -1;
+	}
+	return 0;
+}
+
+/* Keep the average time taken to verify a wrong password up to date */
+static void
+auth_attack_verified(Authctxt *authctxt, const char *method,
+    int authenticated)
+{
+	struct auth_timeline *tl = auth_timeline(authctxt);
+	u_int64_t now = monotime_nsec();
+	double t;
+
+	if (authenticated || strcmp(method, "password") != 0 ||
+	    tl->stamp[AUTH_TL_DISPATCH] == 0)
+		return;
+	t = auth_timeline_span(tl->stamp[AUTH_TL_DISPATCH], now);
+	if (!auth_verify_timed)
+		auth_verify_time = t;
+	else
+		auth_verify_time += AUTH_VERIFY_WEIGHT * (t - auth_verify_time);
+	auth_verify_timed = 1;
+}
+
+/*
+ * Once an attempt on the connection has been judged an attack, it may be
+ * allowed fewer tries than MaxAuthTries.
+ */
+static int
+auth_max_tries(Authctxt *authctxt)
+{
+	int n = options.max_authtries;
+
+	if (auth_timeline(authctxt)->nflagged > 0 &&
+	    options.auth_time_attack_max_tries > 0 &&
+	    options.auth_time_attack_max_tries < n)
+		n = options.auth_time_attack_max_tries;
+	return n;
+}
+
+/*
+ * Called before the reply to a failed attempt: disconnect a connection
+ * with AuthTimeAttackDisconnect attempts judged an attack, or hold back
+ * the reply to one judged an attack for AuthTimeTarpit seconds, doubled
+ * for each earlier such attempt up to its maximum. The reply to an
+ * attempt rejected unverified is held for its padding as well. Returns 1
+ * if the reply is to be held: the dispatch loop of do_authentication2()
+ * then waits out the hold in auth_attack_hold() and sends it.
+ *
+ * A connection held back still counts against MaxStartups, so every
+ * attacker being tarpitted takes up a slot that legitimate clients could
+ * use. The holds on a connection therefore come to at most half of
+ * LoginGraceTime in all (or, without one, the AuthTimeTarpit maximum);
+ * one that would take them further disconnects instead.
+ */
+static int
+auth_attack_respond(Authctxt *authctxt)
+{
+	struct auth_timeline *tl = auth_timeline(authctxt);
+	double delay = 0, budget, pad = tl->pad;
+	u_int i;
+
+	tl->pad = 0;
+	if (tl->classified && tl->attack) {
+		if (options.auth_time_attack_disconnect > 0 &&
+		    tl->nflagged >=
+		    (u_int)options.auth_time_attack_disconnect) {
+			PRIVSEP(auth_attack_count(AUTH_ACT_DISCONNECTED));
+			packet_disconnect(AUTH_FAIL_MSG, authctxt->user);
+		}
+		if (options.auth_time_tarpit > 0) {
+			delay = options.auth_time_tarpit;
+			for (i = 1; i < tl->nflagged &&
+			    delay < options.auth_time_tarpit_max; i++)
+				delay *= 2;
+			if (delay > options.auth_time_tarpit_max)
+				delay = options.auth_time_tarpit_max;
+		}
+	}
+	if (delay > 0) {
+		budget = options.login_grace_time > 0 ?
+		    options.login_grace_time / 2.0 :
+		    options.auth_time_tarpit_max;
+		if (tl->held + delay > budget) {
+			debug("%s: %.3f seconds held already", __func__,
+			    tl->held);
+			PRIVSEP(auth_attack_count(AUTH_ACT_DISCONNECTED));
+			packet_disconnect(AUTH_FAIL_MSG, authctxt->user);
+		}
+		PRIVSEP(auth_attack_count(AUTH_ACT_TARPITTED));
+		tl->held += delay;
+	}
+	if (delay + pad <= 0)
+		return 0;
+	debug("%s: holding reply %.3f seconds", __func__, delay + pad);
+	tl->release = monotime_nsec() + (u_int64_t)((delay + pad) * 1e9);
+	tl->holding = tl->stop = 1;
+	return 1;
+}
+
+/*
+ * Wait out the hold on a failure reply, then send it. The connection is
+ * still read meanwhile, so that a client that gives up is noticed at
+ * once; what it sends is queued, and dispatched after the reply.
+ */
+static void
+auth_attack_hold(Authctxt *authctxt)
+{
+	struct auth_timeline *tl = auth_timeline(authctxt);
+	struct pollfd pfd;
+	char buf[8192];
+	u_int64_t now;
+	ssize_t len;
+
+	pfd.fd = packet_get_connection_in();
+	pfd.events = POLLIN;
+	while ((now = monotime_nsec()) < tl->release) {
+		if (poll(&pfd, 1, (int)((tl->release - now + 999999) /
+		    1000000)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fatal("%s: poll: %s", __func__, strerror(errno));
+		}
+		if (pfd.revents == 0)
+			continue;
+		len = read(pfd.fd, buf, sizeof(buf));
+		if (len == 0) {
+			logit("Connection closed by %.100s while held",
+			    get_remote_ipaddr());
+			cleanup_exit(255);
+		}
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EWOULDBLOCK)
+				continue;
+			logit("Read error from remote host %.100s: %.100s",
+			    get_remote_ipaddr(), strerror(errno));
+			cleanup_exit(255);
+		}
+		packet_process_incoming(buf, len);
+	}
+	tl->holding = 0;
+	userauth_send_failure(authctxt, tl->held_partial, tl->held_restart);
+}
+
 char *
 auth2_read_banner(void)
 {
@@ -193,9 +588,17 @@ done:
 void
 do_authentication2(Authctxt *authctxt)
 {
+	struct auth_timeline *tl = auth_timeline(authctxt);
+
 	dispatch_init(&dispatch_protocol_error);
 	dispatch_set(SSH2_MSG_SERVICE_REQUEST, &input_service_request);
-	dispatch_run(DISPATCH_BLOCK, &authctxt->success, authctxt);
+	/* Success ends authentication; a held failure reply interrupts it */
+	while (!authctxt->success) {
+		tl->stop = 0;
+		dispatch_run(DISPATCH_BLOCK, &tl->stop, authctxt);
+		if (tl->holding)
+			auth_attack_hold(authctxt);
+	}
 }
 
 /*ARGSUSED*/
@@ -203,6 +606,7 @@ static void
 input_service_request(int type, u_int32_t seq, void *ctxt)
 {
 	Authctxt *authctxt = ctxt;
+	struct auth_timeline *tl;
 	u_int len;
 	int acceptit = 0;
 	char *service = packet_get_cstring(&len);
@@ -245,8 +649,10 @@ input_service_request(int type, u_int32_t seq, void *ctxt)
         //HPING_RTT_DOUBLE = HPING_RTT_DOUBLE * 0.001; //hpingの実行結果(RTT)をミリ秒から普通の秒単位に変換
 
 
-	    gettimeofday(&s, NULL); //認証開始時間
-        //認証開始時間はnoneメソッドを送信するツールに対してはuserauth_finish関数内のものを，そうでないものはここで取得しているものが認証開始時間となる
+		tl = auth_timeline(authctxt);
+		tl->stamp[AUTH_TL_SERVICE_ACCEPT] = tl->start = monotime_nsec();
+		tl->kexinit = KEXINIT_TIME;
+		tl->newkeys = NEWKEYS_TIME;
 
 
 	} else {
@@ -268,14 +674,14 @@ input_userauth_request(int type, u_int32_t seq, void *ctxt)
 	if (authctxt == NULL)
 		fatal("input_userauth_request: no authctxt");
 
+	auth_timeline_mark(authctxt, AUTH_TL_REQUEST);
+	auth_timeline(authctxt)->classified = 0;
 	user = packet_get_cstring(NULL);
 	service = packet_get_cstring(NULL);
 	method = packet_get_cstring(NULL);
 	debug("userauth-request for user %s service %s method %s", user, service, method);
 	debug("attempt %d failures %d", authctxt->attempt, authctxt->failures);
 
-    USER = user; //AuthInfo用にユーザ名をグローバル変数に格納
-
 	if ((style = strchr(user, ':')) != NULL)
 		*style++ = 0;
 
@@ -326,9 +732,12 @@ input_userauth_request(int type, u_int32_t seq, void *ctxt)
 
 	/* try to authenticate user */
 	m = authmethod_lookup(authctxt, method);
-	if (m != NULL && authctxt->failures < options.max_authtries) {
+	if (m != NULL && authctxt->failures < auth_max_tries(authctxt) &&
+	    auth_attack_policy(authctxt, method) == 0) {
 		debug2("input_userauth_request: try method %s", method);
+		auth_timeline_mark(authctxt, AUTH_TL_DISPATCH);
 		authenticated =	m->userauth(authctxt);
+		auth_attack_verified(authctxt, method, authenticated);
 	}
 	userauth_finish(authctxt, authenticated, method, NULL);
 
@@ -341,15 +750,12 @@ void
 userauth_finish(Authctxt *authctxt, int authenticated, const char *method,
     const char *submethod)
 {
-	char *methods;
-	int partial = 0;	
-	struct timeval e;
-    double authtime;
-    /* double AuthTimeThreshold = 0.2044475; */
-    char detection[10];
-	//char *password = "password";
-    struct tm *time_st;
-	
+	struct auth_timeline *tl;
+	int partial = 0, restart;
+
+	/* Postponed methods also finish here */
+	auth_timeline_mark(authctxt, AUTH_TL_VERIFIED);
+
 	if (!authctxt->valid && authenticated)
 		fatal("INTERNAL ERROR: authenticated invalid user %s",
 		    authctxt->user);
@@ -408,120 +814,57 @@ userauth_finish(Authctxt *authctxt, int authenticated, const char *method,
 		packet_write_wait();
 		/* now we can break out */
 		authctxt->success = 1;
+		auth_timeline(authctxt)->stop = 1;
 
-
-		gettimeofday(&e, NULL);
-        time_st = localtime(&e.tv_sec); //現在時刻を現地化
-
-		//コネクション中の最初の認証のみ開始時間をinput_service_request関数内のs，それ以降はuserauth_finish関数内のs2とする
-		if(MULTIPLE_AUTH == 0){
-			authtime = (e.tv_sec - s.tv_sec) + (e.tv_usec - s.tv_usec) * 1.0E-6;
-		}else{
-			authtime = (e.tv_sec - s2.tv_sec) + (e.tv_usec - s2.tv_usec) * 1.0E-6;
-		}
-
-
-		if (authtime < AuthTimeThreshold) {
-			strcpy(detection, "Attack");
-		} else {
-			strcpy(detection, "Normal");
-		}
-
-        logit("[Auth:Success,User:%s,IP:%s,Time:%lf,Detect:%s,RTT:%06lf,Year:%d,Month:%02d,Day:%02d,Hour:%02d,Minute:%02d,Second:%02d,MicroSec:%06d]KEXINIT:%lf,NEWKEYS:%lf",
-              USER,
-              get_remote_ipaddr(),
-              authtime,
-              detection,
-              ((KEXINIT_TIME + NEWKEYS_TIME)/2),
-              time_st->tm_year+1900,
-              time_st->tm_mon+1,
-              time_st->tm_mday,
-              time_st->tm_hour,
-              time_st->tm_min,
-              time_st->tm_sec,
-              e.tv_usec,
-              KEXINIT_TIME,
-              NEWKEYS_TIME
-        );
-
-
+		/* Only password attempts are timed */
+		if (strcmp(method, "password") == 0)
+			auth_detect_log(authctxt, 1);
 	} else {
-
-        if(strcmp(method,"password") == 0) { /* password認証前のnone，公開鍵認証の失敗は無視 */
-            gettimeofday(&e, NULL); //認証終了時間
-            time_st = localtime(&e.tv_sec); //現在時刻を現地化
-
-		//コネクション中の最初の認証のみ開始時間をinput_service_request関数内のs，それ以降はuserauth_finish関数内のs2とする
-            if (MULTIPLE_AUTH == 0){
-                authtime = (e.tv_sec - s.tv_sec) + (e.tv_usec - s.tv_usec) * 1.0E-6;
-                //logit("in 0");
-            }else{
-                authtime = (e.tv_sec - s2.tv_sec) + (e.tv_usec - s2.tv_usec) * 1.0E-6;
-                //logit("in 1");
-            }
-
-
-            if (authtime < AuthTimeThreshold) {
-				strcpy(detection, "Attack");
-			} else {
-				strcpy(detection, "Normal");
-			}
-
-
-			logit("[Auth:Fail,User:%s,IP:%s,Time:%lf,Detect:%s,RTT:%06lf,Year:%d,Month:%02d,Day:%02d,Hour:%02d,Minute:%02d,Second:%02d,MicroSec:%06d]KEXINIT:%lf,NEWKEYS:%lf",
-				  USER,
-				  get_remote_ipaddr(),
-				  authtime,
-				  detection,
-                  ((KEXINIT_TIME + NEWKEYS_TIME)/2),
-                  time_st->tm_year+1900,
-                  time_st->tm_mon+1,
-                  time_st->tm_mday,
-                  time_st->tm_hour,
-                  time_st->tm_min,
-                  time_st->tm_sec,
-                  e.tv_usec,
-                  KEXINIT_TIME,
-                  NEWKEYS_TIME
-			);
-
-		}
+		if (strcmp(method, "password") == 0)
+			auth_detect_log(authctxt, 0);
 
 		/* Allow initial try of "none" auth without failure penalty */
 		if (!authctxt->server_caused_failure &&
 		    (authctxt->attempt > 1 || strcmp(method, "none") != 0))
 			authctxt->failures++;
-		if (authctxt->failures >= options.max_authtries) {
+		if (authctxt->failures >= auth_max_tries(authctxt)) {
 #ifdef SSH_AUDIT_EVENTS
 			PRIVSEP(audit_event(SSH_LOGIN_EXCEED_MAXTRIES));
 #endif
+			if (authctxt->failures < options.max_authtries)
+				PRIVSEP(auth_attack_count(AUTH_ACT_MAXTRIES));
 			packet_disconnect(AUTH_FAIL_MSG, authctxt->user);
 		}
-		methods = authmethods_get(authctxt);
-		debug3("%s: failure partial=%d next methods=\"%s\"", __func__,
-		    partial, methods);
-		packet_start(SSH2_MSG_USERAUTH_FAILURE);
-		packet_put_cstring(methods);
-		packet_put_char(partial);
-		packet_send();
-		packet_write_wait();
-		free(methods);
-
-        //logit("%s",method);
-
-		if(strcmp(method,"password") == 0) { //2回目以降の認証試行時に実行される
-			MULTIPLE_AUTH = 1;
-			gettimeofday(&s2, NULL);
-			//logit("received password method.");
+		/* The next attempt is timed from the reply */
+		restart = strcmp(method, "password") == 0 ||
+		    strcmp(method, "none") == 0;
+		if (auth_attack_respond(authctxt)) {
+			tl = auth_timeline(authctxt);
+			tl->held_partial = partial;
+			tl->held_restart = restart;
+			return;
 		}
+		userauth_send_failure(authctxt, partial, restart);
+	}
+}
 
-        if(strcmp(method,"none") == 0) { //最初の認証試行時に実行される
-            gettimeofday(&s, NULL);
-            //logit("received none method. started userauth. ");
-        }
+static void
+userauth_send_failure(Authctxt *authctxt, int partial, int restart)
+{
+	char *methods;
 
+	methods = authmethods_get(authctxt);
+	debug3("%s: failure partial=%d next methods=\"%s\"", __func__,
+	    partial, methods);
+	packet_start(SSH2_MSG_USERAUTH_FAILURE);
+	packet_put_cstring(methods);
+	packet_put_char(partial);
+	packet_send();
+	packet_write_wait();
+	free(methods);
 
-	}
+	if (restart)
+		auth_timeline_restart(authctxt);
 }
 
 /*
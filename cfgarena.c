@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "cfgarena.h"
+
+/*
+ * The arenas that sshd's compiled configuration is allocated from (see
+ * parse_server_config()).
+ *
+ * Strings compiled from the main configuration are carved out of an
+ * arena rather than allocated one by one, and the text they were parsed
+ * from is kept in it so that directive arguments can be referenced in
+ * place.  Match overlays and the options they are applied to then share
+ * these strings by pointer.  An arena is never freed piecemeal: it lasts
+ * as long as the process, as options compiled from it may still be in use.
+ */
+#define CFG_ARENA_CHUNK		(64 * 1024)
+#define CFG_ARENA_ALIGN		sizeof(void *)
+
+struct cfg_chunk {
+	struct cfg_chunk *next;
+	char	*base;
+	size_t	 size, used;
+};
+
+struct cfg_arena {
+	struct cfg_arena *prev;		/* older arena, possibly still in use */
+	struct cfg_chunk *chunks;	/* most recent chunk first */
+	size_t	 total;
+};
+
+static struct cfg_arena *cfg_arena = NULL;
+static int cfg_arena_active = 0;	/* allocate from cfg_arena */
+
+/*
+ * Start a new arena for a configuration about to be compiled, and allocate
+ * from it until cfg_arena_end().
+ */
+void
+cfg_arena_begin(void)
+{
+	struct cfg_arena *a;
+
+	a = xcalloc(1, sizeof(*a));
+	a->prev = cfg_arena;
+	cfg_arena = a;
+	cfg_arena_active = 1;
+}
+
+/* Stop allocating from the arena. Returns the bytes it holds */
+size_t
+cfg_arena_end(void)
+{
+	cfg_arena_active = 0;
+	return cfg_arena->total;
+}
+
+void *
+cfg_alloc(size_t len)
+{
+	struct cfg_chunk *ch;
+	size_t size;
+
+	if (!cfg_arena_active)
+		return xmalloc(len);
+	len = (len + CFG_ARENA_ALIGN - 1) & ~(CFG_ARENA_ALIGN - 1);
+	if ((ch = cfg_arena->chunks) == NULL || ch->size - ch->used < len) {
+		/* Grow geometrically so large configs need few chunks */
+		size = ch == NULL ? CFG_ARENA_CHUNK : ch->size * 2;
+		if (size < len)
+			size = len;
+		ch = xcalloc(1, sizeof(*ch));
+		ch->base = xmalloc(size);
+		ch->size = size;
+		ch->next = cfg_arena->chunks;
+		cfg_arena->chunks = ch;
+		cfg_arena->total += size;
+	}
+	ch->used += len;
+	return ch->base + ch->used - len;
+}
+
+/* Returns 1 if p lies in memory belonging to any live arena */
+int
+cfg_owned(const void *p)
+{
+	struct cfg_arena *a;
+	struct cfg_chunk *ch;
+	const char *cp = p;
+
+	if (p == NULL)
+		return 0;
+	for (a = cfg_arena; a != NULL; a = a->prev)
+		for (ch = a->chunks; ch != NULL; ch = ch->next)
+			if (cp >= ch->base && cp < ch->base + ch->size)
+				return 1;
+	return 0;
+}
+
+/* Copy a string into the arena, or onto the heap when not compiling */
+char *
+cfg_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	if (!cfg_arena_active)
+		return xstrdup(s);
+	return memcpy(cfg_alloc(len), s, len);
+}
+
+/*
+ * Returns a string that may be stored in the options. Arguments parsed
+ * out of the arena's copy of the config text are used in place.
+ */
+char *
+cfg_strref(const char *s)
+{
+	if (cfg_arena_active && cfg_owned(s))
+		return (char *)s;
+	return cfg_strdup(s);
+}
+
+/* Moves a heap string into the arena while compiling */
+char *
+cfg_strown(char *s)
+{
+	char *ret;
+
+	if (!cfg_arena_active || s == NULL)
+		return s;
+	ret = cfg_strdup(s);
+	free(s);
+	return ret;
+}
+
+/* Frees a string unless an arena owns it */
+void
+cfg_free(void *p)
+{
+	if (!cfg_owned(p))
+		free(p);
+}
+
+/* Frees a list of strings and those of them no arena owns */
+void
+cfg_free_list(char **list, u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n; i++)
+		cfg_free(list[i]);
+	free(list);
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "match.h"
+#include "shcache.h"
+#include "patternset.h"
+
+/*
+ * A compiled set of match_pattern() patterns, for testing a string against
+ * a whole list at once. Patterns without wildcards are kept in a hash
+ * table. The others are combined into a single bit-parallel (shift-and)
+ * automaton: each pattern has a start bit and one bit per literal or '?',
+ * and a bit followed by '*' may stay set on any character.  Testing a
+ * string is then one pass over it however many patterns there are.
+ */
+struct pattern_exact {
+	char	*s;		/* NULL for an empty slot */
+	u_int	 id;
+};
+
+struct pattern_set {
+	u_int	  npatterns;
+	char	**pat;		/* patterns, lowercased if dolower */
+	u_char	 *neg;		/* pattern was negated in its list */
+	int	  dolower;
+	char	 *fallback;	/* list for match_pattern_list() instead */
+	u_int	  exact_size;	/* hash slots, a power of two */
+	struct pattern_exact *exact;
+	u_int	  nbits, nwords;
+	u_int64_t *cmask;	/* per character, the bits it may set */
+	u_int64_t *start;	/* state before the first character */
+	u_int64_t *loop;	/* bits followed by '*' */
+	u_int64_t *accept;	/* final bit of each pattern */
+	u_int64_t *accept_neg;	/* final bit of each negated pattern */
+	u_int64_t *state;	/* scratch */
+	u_int	 *bit_id;	/* pattern owning each bit */
+};
+
+#define PSET_SET(v, b)	((v)[(b) / 64] |= (u_int64_t)1 << ((b) % 64))
+
+struct pattern_set *
+pattern_set_new(int dolower)
+{
+	struct pattern_set *ps;
+
+	ps = xcalloc(1, sizeof(*ps));
+	ps->dolower = dolower;
+	return ps;
+}
+
+void
+pattern_set_add(struct pattern_set *ps, const char *pat, size_t len, int neg)
+{
+	char *cp;
+	size_t i;
+
+	cp = xmalloc(len + 1);
+	for (i = 0; i < len; i++)
+		cp[i] = ps->dolower && isupper((u_char)pat[i]) ?
+		    tolower((u_char)pat[i]) : pat[i];
+	cp[len] = '\0';
+	/*
+	 * match_pattern() only accepts a trailing run of two or more '*'
+	 * if at least one character is left to match, i.e. as "?*".
+	 */
+	for (i = len; i > 0 && cp[i - 1] == '*'; i--)
+		;
+	if (len - i >= 2)
+		strlcpy(cp + i, "?*", len + 1 - i);
+	ps->pat = xrealloc(ps->pat, ps->npatterns + 1, sizeof(*ps->pat));
+	ps->neg = xrealloc(ps->neg, ps->npatterns + 1, sizeof(*ps->neg));
+	ps->pat[ps->npatterns] = cp;
+	ps->neg[ps->npatterns] = neg != 0;
+	ps->npatterns++;
+}
+
+/* Build the hash table and automaton once all patterns have been added */
+void
+pattern_set_finish(struct pattern_set *ps)
+{
+	struct pattern_exact *e;
+	u_int i, c, bit, nexact = 0;
+	const char *cp;
+
+	for (i = 0; i < ps->npatterns; i++) {
+		if (strcspn(ps->pat[i], "*?") == strlen(ps->pat[i]))
+			nexact++;
+		else
+			ps->nbits += 1 + strlen(ps->pat[i]);	/* at most */
+	}
+	for (ps->exact_size = 8; ps->exact_size < nexact * 2; )
+		ps->exact_size <<= 1;
+	ps->exact = xcalloc(ps->exact_size, sizeof(*ps->exact));
+	if (ps->nbits != 0) {
+		ps->nwords = (ps->nbits + 63) / 64;
+		ps->cmask = xcalloc(256 * ps->nwords, sizeof(*ps->cmask));
+		ps->start = xcalloc(ps->nwords, sizeof(*ps->start));
+		ps->loop = xcalloc(ps->nwords, sizeof(*ps->loop));
+		ps->accept = xcalloc(ps->nwords, sizeof(*ps->accept));
+		ps->accept_neg = xcalloc(ps->nwords, sizeof(*ps->accept_neg));
+		ps->state = xcalloc(ps->nwords, sizeof(*ps->state));
+		ps->bit_id = xcalloc(ps->nbits, sizeof(*ps->bit_id));
+	}
+	for (i = 0, bit = 0; i < ps->npatterns; i++) {
+		if (strcspn(ps->pat[i], "*?") == strlen(ps->pat[i])) {
+			c = fnv1a(FNV1A_INIT, ps->pat[i], strlen(ps->pat[i]));
+			for (e = &ps->exact[c & (ps->exact_size - 1)];
+			    e->s != NULL; ) {
+				if (++e == ps->exact + ps->exact_size)
+					e = ps->exact;
+			}
+			e->s = ps->pat[i];
+			e->id = i;
+			continue;
+		}
+		PSET_SET(ps->start, bit);
+		ps->bit_id[bit] = i;
+		for (cp = ps->pat[i]; *cp != '\0'; cp++) {
+			if (*cp == '*') {
+				PSET_SET(ps->loop, bit);
+				continue;
+			}
+			bit++;
+			ps->bit_id[bit] = i;
+			if (*cp == '?') {
+				for (c = 0; c < 256; c++)
+					PSET_SET(ps->cmask + c * ps->nwords,
+					    bit);
+			} else
+				PSET_SET(ps->cmask +
+				    (u_char)*cp * ps->nwords, bit);
+		}
+		PSET_SET(ps->accept, bit);
+		if (ps->neg[i])
+			PSET_SET(ps->accept_neg, bit);
+		bit++;
+	}
+}
+
+/*
+ * Compile a comma-separated list as match_pattern_list() interprets it.
+ */
+struct pattern_set *
+pattern_set_compile_list(const char *list, int dolower)
+{
+	struct pattern_set *ps;
+	const char *cp = list;
+	size_t len;
+	int neg;
+
+	ps = pattern_set_new(dolower);
+	while (*cp != '\0') {
+		if ((neg = *cp == '!'))
+			cp++;
+		len = strcspn(cp, ",");
+		if (len >= 1023) {
+			/* match_pattern_list() fails on these; let it */
+			ps->fallback = xstrdup(list);
+			break;
+		}
+		pattern_set_add(ps, cp, len, neg);
+		cp += len;
+		if (*cp == ',')
+			cp++;
+	}
+	pattern_set_finish(ps);
+	return ps;
+}
+
+void
+pattern_set_free(struct pattern_set *ps)
+{
+	u_int i;
+
+	if (ps == NULL)
+		return;
+	for (i = 0; i < ps->npatterns; i++)
+		free(ps->pat[i]);
+	free(ps->pat);
+	free(ps->neg);
+	free(ps->fallback);
+	free(ps->exact);
+	free(ps->cmask);
+	free(ps->start);
+	free(ps->loop);
+	free(ps->accept);
+	free(ps->accept_neg);
+	free(ps->state);
+	free(ps->bit_id);
+	free(ps);
+}
+
+/* Run the automaton over s, leaving the final state in ps->state */
+static void
+pattern_set_run(struct pattern_set *ps, const char *s)
+{
+	u_int64_t *d = ps->state, *m, w, carry, live;
+	u_int i;
+
+	memcpy(d, ps->start, ps->nwords * sizeof(*d));
+	for (; *s != '\0'; s++) {
+		m = ps->cmask + (u_char)*s * ps->nwords;
+		carry = live = 0;
+		for (i = 0; i < ps->nwords; i++) {
+			w = d[i];
+			d[i] = (((w << 1) | carry) & m[i]) | (w & ps->loop[i]);
+			carry = w >> 63;
+			live |= d[i];
+		}
+		if (live == 0)
+			break;
+	}
+}
+
+/*
+ * Find the patterns matching s, storing their ids in ids (which must have
+ * room for every pattern). Returns the number found.
+ */
+u_int
+pattern_set_match_ids(struct pattern_set *ps, const char *s, u_int *ids)
+{
+	struct pattern_exact *e;
+	u_int i, b, n = 0;
+	u_int64_t w;
+
+	i = fnv1a(FNV1A_INIT, s, strlen(s)) & (ps->exact_size - 1);
+	for (e = &ps->exact[i]; e->s != NULL; ) {
+		if (strcmp(e->s, s) == 0)
+			ids[n++] = e->id;
+		if (++e == ps->exact + ps->exact_size)
+			e = ps->exact;
+	}
+	if (ps->nwords == 0)
+		return n;
+	pattern_set_run(ps, s);
+	for (i = 0; i < ps->nwords; i++) {
+		w = ps->state[i] & ps->accept[i];
+		for (b = 0; w != 0; b++, w >>= 1)
+			if (w & 1)
+				ids[n++] = ps->bit_id[i * 64 + b];
+	}
+	return n;
+}
+
+/* As match_pattern_list(): 1 on a match, -1 on a negated match, else 0 */
+int
+pattern_set_match_list(struct pattern_set *ps, const char *s)
+{
+	struct pattern_exact *e;
+	u_int i;
+	int found = 0;
+
+	if (ps->fallback != NULL)
+		return match_pattern_list(s, ps->fallback,
+		    strlen(ps->fallback), ps->dolower);
+	i = fnv1a(FNV1A_INIT, s, strlen(s)) & (ps->exact_size - 1);
+	for (e = &ps->exact[i]; e->s != NULL; ) {
+		if (strcmp(e->s, s) == 0) {
+			if (ps->neg[e->id])
+				return -1;
+			found = 1;
+		}
+		if (++e == ps->exact + ps->exact_size)
+			e = ps->exact;
+	}
+	if (ps->nwords == 0)
+		return found;
+	pattern_set_run(ps, s);
+	for (i = 0; i < ps->nwords; i++) {
+		if ((ps->state[i] & ps->accept_neg[i]) != 0)
+			return -1;
+		if ((ps->state[i] & ps->accept[i]) != 0)
+			found = 1;
+	}
+	return found;
+}
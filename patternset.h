@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _PATTERNSET_H
+#define _PATTERNSET_H
+
+struct pattern_set;
+
+struct pattern_set *pattern_set_new(int);
+void	 pattern_set_add(struct pattern_set *, const char *, size_t, int);
+void	 pattern_set_finish(struct pattern_set *);
+struct pattern_set *pattern_set_compile_list(const char *, int);
+void	 pattern_set_free(struct pattern_set *);
+u_int	 pattern_set_match_ids(struct pattern_set *, const char *, u_int *);
+int	 pattern_set_match_list(struct pattern_set *, const char *);
+
+#endif /* _PATTERNSET_H */
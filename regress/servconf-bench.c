@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Times the server configuration code: load_server_config(),
+ * parse_server_config(), parse_server_match_config() for each connection
+ * spec, copy_set_server_options() and dump_config().  For each phase it
+ * reports the calls made, the time taken, ops/sec and the allocations
+ * and bytes allocated per call through the xmalloc functions, followed by
+ * the size of ServerOptions and the peak RSS.
+ *
+ * It also times the lookup of every configuration keyword, spelt with a
+ * leading capital as in sshd_config, both by the hash parse_token() uses
+ * ("kwhash") and by the strcasecmp() of each keyword in turn it used to
+ * make ("kwscan").  A call there is one lookup of every keyword.
+ *
+ * With -P, it also starts that many children which, like pre-auth
+ * children, each apply the connection specs in turn to the options they
+ * inherit, and keeps them all alive at once; it then reports what each
+ * allocated and its peak RSS, and the total across them.
+ *
+ * Configurations and connection specs to feed it can be made with
+ * servconf-gen.sh.  The user and group databases are replaced by stubs,
+ * so that Match Group costs the same on every machine; connection specs
+ * give the client's name, so no other lookups are made.
+ *
+ * It is built and run by the "servconf-bench" target of regress/Makefile,
+ * once sshd has been built:
+ *
+ *	servconf-bench: servconf-bench.c ${.CURDIR}/servconf-gen.sh
+ *		${CC} ${CFLAGS} -I${.CURDIR}/.. -I${.CURDIR}/../openbsd-compat \
+ *		    -o ${.OBJDIR}/servconf-bench ${.CURDIR}/servconf-bench.c \
+ *		    ${BUILDDIR}/servconf.o ${BUILDDIR}/cfgarena.o \
+ *		    ${BUILDDIR}/shfile.o ${BUILDDIR}/shcache.o \
+ *		    ${BUILDDIR}/statsfile.o ${BUILDDIR}/patternset.o \
+ *		    ${BUILDDIR}/addrtrie.o -L${BUILDDIR} \
+ *		    -L${BUILDDIR}/openbsd-compat -lssh -lopenbsd-compat ${LIBS}
+ *		sh ${.CURDIR}/servconf-gen.sh > ${.OBJDIR}/servconf-bench.conf
+ *		sh ${.CURDIR}/servconf-gen.sh -s 1000 > ${.OBJDIR}/servconf-bench.specs
+ *		${.OBJDIR}/servconf-bench -f ${.OBJDIR}/servconf-bench.conf \
+ *		    -c ${.OBJDIR}/servconf-bench.specs
+ *
+ * The xmalloc functions defined here take the place of those in libssh.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "buffer.h"
+#include "log.h"
+#include "servconf.h"
+
+/* Normally provided by sshd.c and auth2.c */
+int use_privsep = -1;
+double AuthTimeThreshold;
+
+static u_long nallocs, nbytes;
+
+/* As in sshd; AuthenticationMethods is not what is being measured */
+int
+auth2_methods_valid(const char *methods, int need_enable)
+{
+	return 0;
+}
+
+void *
+xmalloc(size_t size)
+{
+	void *ptr;
+
+	if (size == 0)
+		fatal("xmalloc: zero size");
+	if ((ptr = malloc(size)) == NULL)
+		fatal("xmalloc: out of memory (allocating %zu bytes)", size);
+	nallocs++;
+	nbytes += size;
+	return ptr;
+}
+
+void *
+xcalloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size == 0 || nmemb == 0)
+		fatal("xcalloc: zero size");
+	if (SIZE_T_MAX / nmemb < size)
+		fatal("xcalloc: nmemb * size > SIZE_T_MAX");
+	if ((ptr = calloc(1, size * nmemb)) == NULL)
+		fatal("xcalloc: out of memory (allocating %zu bytes)",
+		    size * nmemb);
+	nallocs++;
+	nbytes += size * nmemb;
+	return ptr;
+}
+
+void *
+xrealloc(void *ptr, size_t nmemb, size_t size)
+{
+	void *new_ptr;
+	size_t new_size = nmemb * size;
+
+	if (new_size == 0)
+		fatal("xrealloc: zero size");
+	if (SIZE_T_MAX / nmemb < size)
+		fatal("xrealloc: nmemb * size > SIZE_T_MAX");
+	if ((new_ptr = realloc(ptr, new_size)) == NULL)
+		fatal("xrealloc: out of memory (new_size %zu bytes)",
+		    new_size);
+	nallocs++;
+	nbytes += new_size;
+	return new_ptr;
+}
+
+char *
+xstrdup(const char *str)
+{
+	size_t len;
+	char *cp;
+
+	len = strlen(str) + 1;
+	cp = xmalloc(len);
+	strlcpy(cp, str, len);
+	return cp;
+}
+
+int
+xasprintf(char **ret, const char *fmt, ...)
+{
+	va_list ap;
+	int i;
+
+	va_start(ap, fmt);
+	i = vasprintf(ret, fmt, ap);
+	va_end(ap);
+
+	if (i < 0 || *ret == NULL)
+		fatal("xasprintf: could not allocate memory");
+	nallocs++;
+	nbytes += i + 1;
+	return (i);
+}
+
+/*
+ * Stub user and group databases.  Every user exists; its gid and
+ * supplementary groups are derived from its name, and group N is "gN".
+ */
+#define STUB_NGROUPS	4
+
+static u_int
+stub_hash(const char *s)
+{
+	u_int h = 5381;
+
+	for (; *s != '\0'; s++)
+		h = h * 33 + (u_char)*s;
+	return h;
+}
+
+struct passwd *
+getpwnam(const char *name)
+{
+	static struct passwd pw;
+	static char pw_name[256];
+
+	strlcpy(pw_name, name, sizeof(pw_name));
+	memset(&pw, 0, sizeof(pw));
+	pw.pw_name = pw_name;
+	pw.pw_passwd = "*";
+	pw.pw_uid = 1000 + stub_hash(name) % 60000;
+	pw.pw_gid = pw.pw_uid;
+	pw.pw_dir = "/nonexistent";
+	pw.pw_shell = "/bin/sh";
+	return &pw;
+}
+
+int
+getgrouplist(const char *user, gid_t group, gid_t *groups, int *ngroups)
+{
+	u_int h = stub_hash(user);
+	int i, n = *ngroups;
+
+	*ngroups = STUB_NGROUPS;
+	if (n < STUB_NGROUPS)
+		return -1;
+	groups[0] = group;
+	for (i = 1; i < STUB_NGROUPS; i++)
+		groups[i] = (h >> (i * 5)) % 64;
+	return STUB_NGROUPS;
+}
+
+struct group *
+getgrgid(gid_t gid)
+{
+	static struct group gr;
+	static char gr_name[32];
+	static char *gr_mem[] = { NULL };
+
+	snprintf(gr_name, sizeof(gr_name), "g%u", (u_int)gid);
+	memset(&gr, 0, sizeof(gr));
+	gr.gr_name = gr_name;
+	gr.gr_passwd = "*";
+	gr.gr_gid = gid;
+	gr.gr_mem = gr_mem;
+	return &gr;
+}
+
+enum phase {
+	PH_LOAD, PH_PARSE, PH_MATCH, PH_COPY, PH_DUMP, PH_KWSCAN, PH_KWHASH,
+	PH_MAX
+};
+
+static struct {
+	const char *name;
+	u_long	 calls;
+	u_long	 allocs;
+	u_long	 bytes;
+	double	 secs;
+} phases[PH_MAX] = {
+	{ "load", 0, 0, 0, 0 },
+	{ "parse", 0, 0, 0, 0 },
+	{ "match", 0, 0, 0, 0 },
+	{ "copy", 0, 0, 0, 0 },
+	{ "dump", 0, 0, 0, 0 },
+	{ "kwscan", 0, 0, 0, 0 },
+	{ "kwhash", 0, 0, 0, 0 },
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		fatal("clock_gettime: %s", strerror(errno));
+	return ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static void
+phase_add(enum phase ph, double secs, u_long allocs, u_long bytes)
+{
+	phases[ph].calls++;
+	phases[ph].secs += secs;
+	phases[ph].allocs += allocs;
+	phases[ph].bytes += bytes;
+}
+
+/*
+ * Parsing a configuration leaves state behind that a second parse in the
+ * same process does not clean up, as sshd parses only once.  Each timed
+ * parse is therefore made in a child of its own.
+ */
+static void
+time_parse(const char *path, Buffer *conf)
+{
+	ServerOptions o;
+	double r[3], start;
+	u_long n, b;
+	int fd[2], status;
+	pid_t pid;
+
+	if (pipe(fd) == -1)
+		fatal("pipe: %s", strerror(errno));
+	if ((pid = fork()) == -1)
+		fatal("fork: %s", strerror(errno));
+	if (pid == 0) {
+		close(fd[0]);
+		n = nallocs;
+		b = nbytes;
+		start = now();
+		initialize_server_options(&o);
+		parse_server_config(&o, path, conf, NULL);
+		r[0] = now() - start;
+		r[1] = nallocs - n;
+		r[2] = nbytes - b;
+		if (write(fd[1], r, sizeof(r)) != sizeof(r))
+			_exit(1);
+		_exit(0);
+	}
+	close(fd[1]);
+	if (read(fd[0], r, sizeof(r)) != sizeof(r))
+		fatal("parse of %s failed", path);
+	close(fd[0]);
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			fatal("waitpid: %s", strerror(errno));
+	phase_add(PH_PARSE, r[0], (u_long)r[1], (u_long)r[2]);
+}
+
+/* The lookup parse_token() made before it had a hash */
+static int
+keyword_scan(const char *cp)
+{
+	const char *name;
+	u_int i;
+
+	for (i = 0; (name = server_keyword_name(i)) != NULL; i++)
+		if (strcasecmp(cp, name) == 0)
+			return i;
+	return -1;
+}
+
+static void
+time_keywords(u_int iterations)
+{
+	char **tokens;
+	const char *name;
+	double start;
+	u_int i, j, ntokens;
+	volatile int sink = 0;
+
+	for (ntokens = 0; server_keyword_name(ntokens) != NULL; ntokens++)
+		;
+	tokens = xcalloc(ntokens, sizeof(*tokens));
+	for (i = 0; i < ntokens; i++) {
+		name = server_keyword_name(i);
+		tokens[i] = xstrdup(name);
+		tokens[i][0] = toupper((u_char)tokens[i][0]);
+		if (keyword_scan(tokens[i]) != (int)i ||
+		    server_keyword_lookup(tokens[i]) != (int)i)
+			fatal("keyword lookups disagree on \"%s\"", name);
+	}
+	for (i = 0; i < iterations; i++) {
+		start = now();
+		for (j = 0; j < ntokens; j++)
+			sink += keyword_scan(tokens[j]);
+		phase_add(PH_KWSCAN, now() - start, 0, 0);
+		start = now();
+		for (j = 0; j < ntokens; j++)
+			sink += server_keyword_lookup(tokens[j]);
+		phase_add(PH_KWHASH, now() - start, 0, 0);
+	}
+	for (i = 0; i < ntokens; i++)
+		free(tokens[i]);
+	free(tokens);
+}
+
+static void
+add_spec(struct connection_info **specs, u_int *nspecs, char *spec)
+{
+	struct connection_info *ci;
+
+	*specs = xrealloc(*specs, *nspecs + 1, sizeof(**specs));
+	ci = &(*specs)[*nspecs];
+	memset(ci, 0, sizeof(*ci));
+	if (parse_server_match_testspec(ci, spec) == -1 ||
+	    server_match_spec_complete(ci) != 1)
+		fatal("bad connection spec \"%s\"", spec);
+	(*nspecs)++;
+}
+
+static void
+load_specs(struct connection_info **specs, u_int *nspecs, const char *path)
+{
+	char line[1024], *cp;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		fatal("%s: %s", path, strerror(errno));
+	while (fgets(line, sizeof(line), f) != NULL) {
+		cp = line + strspn(line, " \t");
+		cp[strcspn(cp, "\r\n")] = '\0';
+		if (*cp != '\0' && *cp != '#')
+			add_spec(specs, nspecs, cp);
+	}
+	fclose(f);
+}
+
+/*
+ * Start nchildren children that each apply every spec to the options they
+ * inherit, as a pre-auth child applies the spec of its connection, and
+ * hold them until all have done so, so that their memory is in use at
+ * once.  Each reports the bytes it allocated and its peak RSS.
+ */
+static void
+run_children(ServerOptions *options, struct connection_info *specs,
+    u_int nspecs, u_int nchildren)
+{
+	struct rusage ru;
+	u_long r[2], allocated = 0, maxrss = 0, total = 0;
+	u_int i, j;
+	int report[2], hold[2], status;
+	pid_t *pids;
+	char c;
+
+	if (pipe(report) == -1 || pipe(hold) == -1)
+		fatal("pipe: %s", strerror(errno));
+	pids = xcalloc(nchildren, sizeof(*pids));
+	for (i = 0; i < nchildren; i++) {
+		if ((pids[i] = fork()) == -1)
+			fatal("fork: %s", strerror(errno));
+		if (pids[i] != 0)
+			continue;
+		close(report[0]);
+		close(hold[1]);
+		r[0] = nbytes;
+		for (j = 0; j < nspecs; j++)
+			parse_server_match_config(options, &specs[j]);
+		r[0] = nbytes - r[0];
+		r[1] = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+		if (write(report[1], r, sizeof(r)) != sizeof(r))
+			_exit(1);
+		/* Stay until the parent has heard from every child */
+		(void)read(hold[0], &c, 1);
+		_exit(0);
+	}
+	close(report[1]);
+	close(hold[0]);
+	for (i = 0; i < nchildren; i++) {
+		if (read(report[0], r, sizeof(r)) != sizeof(r))
+			fatal("child failed");
+		allocated += r[0];
+		total += r[1];
+		if (r[1] > maxrss)
+			maxrss = r[1];
+	}
+	close(hold[1]);
+	close(report[0]);
+	for (i = 0; i < nchildren; i++)
+		while (waitpid(pids[i], &status, 0) == -1)
+			if (errno != EINTR)
+				fatal("waitpid: %s", strerror(errno));
+	free(pids);
+	printf("children %u: %.0f bytes allocated each, peak rss %lu KB "
+	    "at most, %lu KB in all\n", nchildren,
+	    (double)allocated / nchildren, maxrss, total);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: servconf-bench [-n iterations] "
+	    "[-P children] [-C spec] [-c specfile] -f sshd_config\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	ServerOptions options, copy;
+	struct connection_info *specs = NULL;
+	struct rusage ru;
+	Buffer conf;
+	const char *path = NULL;
+	double start;
+	u_long n, b;
+	u_int i, j, nspecs = 0, iterations = 100, nchildren = 0;
+	int ch, devnull, saved;
+
+	while ((ch = getopt(argc, argv, "C:c:f:n:P:")) != -1) {
+		switch (ch) {
+		case 'C':
+			add_spec(&specs, &nspecs, optarg);
+			break;
+		case 'c':
+			load_specs(&specs, &nspecs, optarg);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'n':
+			if ((iterations = atoi(optarg)) == 0)
+				usage();
+			break;
+		case 'P':
+			if ((nchildren = atoi(optarg)) == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (path == NULL || optind != argc)
+		usage();
+	log_init("servconf-bench", SYSLOG_LEVEL_ERROR, SYSLOG_FACILITY_AUTH,
+	    1);
+
+	buffer_init(&conf);
+	for (i = 0; i < iterations; i++) {
+		buffer_clear(&conf);
+		n = nallocs;
+		b = nbytes;
+		start = now();
+		load_server_config(path, &conf);
+		phase_add(PH_LOAD, now() - start, nallocs - n, nbytes - b);
+	}
+	for (i = 0; i < iterations; i++)
+		time_parse(path, &conf);
+
+	initialize_server_options(&options);
+	parse_server_config(&options, path, &conf, NULL);
+	fill_default_server_options(&options);
+	if (nchildren > 0)
+		run_children(&options, specs, nspecs, nchildren);
+
+	/* As with sshd -T -C, each spec is applied to the same options */
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < nspecs; j++) {
+			n = nallocs;
+			b = nbytes;
+			start = now();
+			parse_server_match_config(&options, &specs[j]);
+			phase_add(PH_MATCH, now() - start, nallocs - n,
+			    nbytes - b);
+		}
+	}
+
+	initialize_server_options(&copy);
+	for (i = 0; i < iterations; i++) {
+		n = nallocs;
+		b = nbytes;
+		start = now();
+		copy_set_server_options(&copy, &options, 0);
+		phase_add(PH_COPY, now() - start, nallocs - n, nbytes - b);
+	}
+
+	fflush(stdout);
+	if ((saved = dup(STDOUT_FILENO)) == -1 ||
+	    (devnull = open("/dev/null", O_WRONLY)) == -1 ||
+	    dup2(devnull, STDOUT_FILENO) == -1)
+		fatal("redirecting stdout: %s", strerror(errno));
+	close(devnull);
+	for (i = 0; i < iterations; i++) {
+		n = nallocs;
+		b = nbytes;
+		start = now();
+		dump_config(&options);
+		fflush(stdout);
+		phase_add(PH_DUMP, now() - start, nallocs - n, nbytes - b);
+	}
+	if (dup2(saved, STDOUT_FILENO) == -1)
+		fatal("restoring stdout: %s", strerror(errno));
+	close(saved);
+
+	time_keywords(iterations);
+
+	printf("%-6s %8s %12s %12s %12s %10s %12s\n", "phase", "calls",
+	    "total s", "avg us", "ops/sec", "allocs", "bytes");
+	for (i = 0; i < PH_MAX; i++) {
+		if (phases[i].calls == 0)
+			continue;
+		printf("%-6s %8lu %12.6f %12.3f %12.0f %10.1f %12.0f\n",
+		    phases[i].name, phases[i].calls, phases[i].secs,
+		    phases[i].secs * 1000000 / phases[i].calls,
+		    phases[i].secs > 0 ? phases[i].calls / phases[i].secs : 0,
+		    (double)phases[i].allocs / phases[i].calls,
+		    (double)phases[i].bytes / phases[i].calls);
+	}
+	printf("ServerOptions %zu bytes\n", sizeof(ServerOptions));
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		printf("peak rss %ld KB\n", (long)ru.ru_maxrss);
+	if (getrusage(RUSAGE_CHILDREN, &ru) == 0)
+		printf("peak rss of a parse %ld KB\n", (long)ru.ru_maxrss);
+	return 0;
+}
@@ -0,0 +1,106 @@
+#!/bin/sh
+#	Placed in the Public Domain.
+#
+# Writes a synthetic sshd_config to stdout, for timing the server
+# configuration code with servconf-bench: NGLOBAL global directives,
+# NMATCH Match blocks mixing User, Group, Address and LocalPort criteria,
+# and AllowUsers and AcceptEnv lists of NUSERS and NENV entries.  With -s,
+# writes NSPECS connection specs for the same configuration instead, one
+# per line, in the form sshd -T -C and servconf-bench -c take.
+#
+# The output depends only on the arguments, so runs can be compared.
+
+usage() {
+	echo "usage: $0 [-g nglobal] [-m nmatch] [-u nusers] [-e nenv] [-s nspecs]" >&2
+	exit 1
+}
+
+NGLOBAL=100
+NMATCH=50
+NUSERS=1000
+NENV=200
+NSPECS=0
+
+while getopts "g:m:u:e:s:" opt; do
+	case "$opt" in
+	g)	NGLOBAL="$OPTARG" ;;
+	m)	NMATCH="$OPTARG" ;;
+	u)	NUSERS="$OPTARG" ;;
+	e)	NENV="$OPTARG" ;;
+	s)	NSPECS="$OPTARG" ;;
+	*)	usage ;;
+	esac
+done
+shift `expr $OPTIND - 1`
+test $# -eq 0 || usage
+
+exec awk -v nglobal="$NGLOBAL" -v nmatch="$NMATCH" -v nusers="$NUSERS" \
+    -v nenv="$NENV" -v nspecs="$NSPECS" '
+# Writes a list directive, wrapping it every "per" entries
+function list(directive, prefix, n, per,	i, line) {
+	line = ""
+	for (i = 0; i < n; i++) {
+		line = line " " prefix i
+		if ((i + 1) % per == 0 || i == n - 1) {
+			print directive line
+			line = ""
+		}
+	}
+}
+
+function specs(	i) {
+	for (i = 0; i < nspecs; i++)
+		printf("user=u%d,host=h%d.example.com,addr=10.%d.%d.%d," \
+		    "laddr=192.0.2.1,lport=%d\n", (i * 7) % nusers, i,
+		    i % 256, (i / 256) % 256, i % 254 + 1, 2200 + i % 16)
+}
+
+function config(	i, j, n) {
+	# Single-valued directives are given once each and then repeated,
+	# as later occurrences are parsed but ignored; Subsystem names
+	# are unique so that every one is kept.
+	n = split("LoginGraceTime 120|ClientAliveInterval 0|" \
+	    "X11Forwarding no|MaxSessions 10|PermitTunnel no|" \
+	    "UseDNS no|TCPKeepAlive yes|MaxAuthTries 6|" \
+	    "PubkeyAuthentication yes|PasswordAuthentication yes", g, "|")
+	for (i = 0; i < nglobal; i++) {
+		if (i % 2 == 0)
+			print g[(i / 2) % n + 1]
+		else
+			printf("Subsystem s%d /usr/libexec/s%d\n", i, i)
+	}
+	if (nusers > 0)
+		list("AllowUsers", "u", nusers, 64)
+	if (nenv > 0)
+		list("AcceptEnv", "LC_VAR", nenv, 64)
+
+	for (i = 0; i < nmatch; i++) {
+		j = i % 6
+		if (j == 0)
+			printf("Match User u%d,u%d*\n", i, i + 1)
+		else if (j == 1)
+			printf("Match Group g%d\n", i % 64)
+		else if (j == 2)
+			printf("Match Address 10.%d.0.0/16\n", i % 256)
+		else if (j == 3)
+			printf("Match LocalPort %d\n", 2200 + i % 16)
+		else if (j == 4)
+			printf("Match User u%d* Address 10.%d.*\n", i % 10,
+			    i % 256)
+		else
+			printf("Match Group g%d,!g%d LocalPort %d\n",
+			    i % 64, (i + 1) % 64, 2200 + i % 16)
+		printf("\tX11Forwarding %s\n", i % 2 ? "yes" : "no")
+		printf("\tMaxSessions %d\n", i % 20 + 1)
+		printf("\tBanner /etc/ssh/banner%d\n", i)
+		printf("\tPermitOpen h%d.example.com:%d\n", i, 1024 + i)
+		printf("\tAllowTcpForwarding %s\n", i % 3 ? "yes" : "no")
+	}
+}
+
+BEGIN {
+	if (nspecs > 0)
+		specs()
+	else
+		config()
+}'
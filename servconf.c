@@ -16,20 +16,33 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <math.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <errno.h>
 #ifdef HAVE_UTIL_H
 #include <util.h>
@@ -44,27 +57,80 @@
 #include "compat.h"
 #include "pathnames.h"
 #include "misc.h"
+#include "atomicio.h"
 #include "cipher.h"
 #include "key.h"
 #include "kex.h"
 #include "mac.h"
 #include "match.h"
 #include "channels.h"
-#include "groupaccess.h"
 #include "canohost.h"
 #include "packet.h"
 #include "hostfile.h"
 #include "auth.h"
+#include "cfgarena.h"
+#include "shfile.h"
+#include "shcache.h"
+#include "statsfile.h"
+#include "patternset.h"
+#include "addrtrie.h"
 
 static void add_listen_addr(ServerOptions *, char *, int);
-static void add_one_listen_addr(ServerOptions *, char *, int);
+static void free_server_options(ServerOptions *);
+static void queue_listen_addr(ServerOptions *, char *, int);
+static void process_queued_listen_addrs(ServerOptions *);
 
 /* Use of privilege separation or not */
 extern int use_privsep;
-extern Buffer cfg;
 
 /* extern double* AuthTimeThreshold; //認証時間しきい値格納用変数 */
 
+/* Append a string to a growable array; the array takes ownership of s */
+static void
+array_append(char ***arrayp, u_int *lp, char *s)
+{
+	*arrayp = xrealloc(*arrayp, *lp + 1, sizeof(**arrayp));
+	(*arrayp)[(*lp)++] = s;
+}
+
+
+/*
+ * Bumped whenever a configuration is compiled or Match settings applied,
+ * so that anything cached by string address is rebuilt once a string may
+ * have been freed and its address reused.
+ */
+static u_int config_generation = 0;
+
+
+static void
+add_port(ServerOptions *options, int port)
+{
+	options->ports = xrealloc(options->ports, options->num_ports + 1,
+	    sizeof(*options->ports));
+	options->ports[options->num_ports++] = port;
+}
+
+static void
+add_host_key(ServerOptions *options, const char *path)
+{
+	array_append(&options->host_key_files, &options->num_host_key_files,
+	    cfg_strown(derelativise_path(path)));
+}
+
+/* Add a listening port given on the command line */
+void
+servconf_add_port(ServerOptions *options, int port)
+{
+	add_port(options, port);
+}
+
+/* Add a host key file given on the command line */
+void
+servconf_add_hostkey(ServerOptions *options, const char *path)
+{
+	add_host_key(options, path);
+}
+
 /* Initializes the server options to their default values. */
 
 void
@@ -79,6 +145,9 @@ initialize_server_options(ServerOptions *options)
 	options->num_ports = 0;
 	options->ports_from_cmdline = 0;
 	options->listen_addrs = NULL;
+	options->queued_listen_addrs = NULL;
+	options->queued_listen_ports = NULL;
+	options->num_queued_listens = 0;
 	options->address_family = -1;
 	options->num_host_key_files = 0;
 	options->num_host_cert_files = 0;
@@ -156,7 +225,23 @@ initialize_server_options(ServerOptions *options)
 	options->ip_qos_interactive = -1;
 	options->ip_qos_bulk = -1;
 	options->version_addendum = NULL;
+	options->match_cache_size = -1;
+	options->group_cache_time = -1;
+	options->hostname_cache_time = -1;
+	options->hostname_lookup_timeout = -1;
+	options->statistics_file = NULL;
 	options->auth_time_threshold = 0.0; /* 認証時間しきい値 */
+	options->auth_time_detection = -1;
+	options->auth_time_sources = -1;
+	options->auth_time_source_file = NULL;
+	options->auth_time_rtt_factor = -1;
+	options->auth_time_rtt_floor = -1;
+	options->auth_time_attack_policy = -1;
+	options->auth_time_attack_delay = -1;
+	options->auth_time_attack_max_tries = -1;
+	options->auth_time_attack_disconnect = -1;
+	options->auth_time_tarpit = -1;
+	options->auth_time_tarpit_max = -1;
 }
 
 void
@@ -172,28 +257,25 @@ fill_default_server_options(ServerOptions *options)
 	if (options->num_host_key_files == 0) {
 		/* fill default hostkeys for protocols */
 		if (options->protocol & SSH_PROTO_1)
-			options->host_key_files[options->num_host_key_files++] =
-			    _PATH_HOST_KEY_FILE;
+			add_host_key(options, _PATH_HOST_KEY_FILE);
 		if (options->protocol & SSH_PROTO_2) {
-			options->host_key_files[options->num_host_key_files++] =
-			    _PATH_HOST_RSA_KEY_FILE;
-			options->host_key_files[options->num_host_key_files++] =
-			    _PATH_HOST_DSA_KEY_FILE;
+			add_host_key(options, _PATH_HOST_RSA_KEY_FILE);
+			add_host_key(options, _PATH_HOST_DSA_KEY_FILE);
 #ifdef OPENSSL_HAS_ECC
-			options->host_key_files[options->num_host_key_files++] =
-			    _PATH_HOST_ECDSA_KEY_FILE;
+			add_host_key(options, _PATH_HOST_ECDSA_KEY_FILE);
 #endif
-			options->host_key_files[options->num_host_key_files++] =
-			    _PATH_HOST_ED25519_KEY_FILE;
+			add_host_key(options,
+			    _PATH_HOST_ED25519_KEY_FILE);
 		}
 	}
 	/* No certificates by default */
 	if (options->num_ports == 0)
-		options->ports[options->num_ports++] = SSH_DEFAULT_PORT;
-	if (options->listen_addrs == NULL)
+		add_port(options, SSH_DEFAULT_PORT);
+	if (options->listen_addrs == NULL && options->num_queued_listens == 0)
 		add_listen_addr(options, NULL, 0);
+	process_queued_listen_addrs(options);
 	if (options->pid_file == NULL)
-		options->pid_file = _PATH_SSH_DAEMON_PID_FILE;
+		options->pid_file = xstrdup(_PATH_SSH_DAEMON_PID_FILE);
 	if (options->server_key_bits == -1)
 		options->server_key_bits = 1024;
 	if (options->login_grace_time == -1)
@@ -217,7 +299,7 @@ fill_default_server_options(ServerOptions *options)
 	if (options->x11_use_localhost == -1)
 		options->x11_use_localhost = 1;
 	if (options->xauth_location == NULL)
-		options->xauth_location = _PATH_XAUTH;
+		options->xauth_location = xstrdup(_PATH_XAUTH);
 	if (options->permit_tty == -1)
 		options->permit_tty = 1;
 	if (options->strict_modes == -1)
@@ -291,10 +373,12 @@ fill_default_server_options(ServerOptions *options)
 	if (options->client_alive_count_max == -1)
 		options->client_alive_count_max = 3;
 	if (options->num_authkeys_files == 0) {
-		options->authorized_keys_files[options->num_authkeys_files++] =
-		    xstrdup(_PATH_SSH_USER_PERMITTED_KEYS);
-		options->authorized_keys_files[options->num_authkeys_files++] =
-		    xstrdup(_PATH_SSH_USER_PERMITTED_KEYS2);
+		array_append(&options->authorized_keys_files,
+		    &options->num_authkeys_files,
+		    xstrdup(_PATH_SSH_USER_PERMITTED_KEYS));
+		array_append(&options->authorized_keys_files,
+		    &options->num_authkeys_files,
+		    xstrdup(_PATH_SSH_USER_PERMITTED_KEYS2));
 	}
 	if (options->permit_tun == -1)
 		options->permit_tun = SSH_TUNMODE_NO;
@@ -304,11 +388,43 @@ fill_default_server_options(ServerOptions *options)
 		options->ip_qos_bulk = IPTOS_THROUGHPUT;
 	if (options->version_addendum == NULL)
 		options->version_addendum = xstrdup("");
+	if (options->match_cache_size == -1)
+		options->match_cache_size = 0;
+	if (options->group_cache_time == -1)
+		options->group_cache_time = 0;
+	if (options->hostname_cache_time == -1)
+		options->hostname_cache_time = 0;
+	if (options->hostname_lookup_timeout == -1)
+		options->hostname_lookup_timeout = 0;
 	/* Turn privilege separation on by default */
 	if (use_privsep == -1)
 		use_privsep = PRIVSEP_NOSANDBOX;
 	if (options->auth_time_threshold == 0.0)  // 認証時間しきい値のデフォルト値設定
 		options->auth_time_threshold = DEFAULT_AUTH_TIME_THRESHOLD;
+	if (options->auth_time_detection == -1)
+		options->auth_time_detection = AUTH_TIME_DETECT_FIXED;
+	if (options->auth_time_sources == -1)
+		options->auth_time_sources = DEFAULT_AUTH_TIME_SOURCES;
+	if (options->auth_time_source_file == NULL)
+		options->auth_time_source_file =
+		    xstrdup(_PATH_SSHD_AUTH_SOURCES);
+	if (options->auth_time_rtt_factor < 0)
+		options->auth_time_rtt_factor = DEFAULT_AUTH_TIME_RTT_FACTOR;
+	if (options->auth_time_rtt_floor < 0)
+		options->auth_time_rtt_floor = DEFAULT_AUTH_TIME_RTT_FLOOR;
+	if (options->auth_time_attack_policy == -1)
+		options->auth_time_attack_policy = AUTH_ATTACK_NONE;
+	if (options->auth_time_attack_delay < 0)
+		options->auth_time_attack_delay =
+		    DEFAULT_AUTH_TIME_ATTACK_DELAY;
+	if (options->auth_time_attack_max_tries == -1)
+		options->auth_time_attack_max_tries = 0;
+	if (options->auth_time_attack_disconnect == -1)
+		options->auth_time_attack_disconnect = 0;
+	if (options->auth_time_tarpit < 0)
+		options->auth_time_tarpit = 0;
+	if (options->auth_time_tarpit_max < 0)
+		options->auth_time_tarpit_max = DEFAULT_AUTH_TIME_TARPIT_MAX;
 
 #ifndef HAVE_MMAP
 	if (use_privsep && options->compression == 1) {
@@ -353,9 +469,15 @@ typedef enum {
 	sRevokedKeys, sTrustedUserCAKeys, sAuthorizedPrincipalsFile,
 	sKexAlgorithms, sIPQoS, sVersionAddendum,
 	sAuthorizedKeysCommand, sAuthorizedKeysCommandUser,
-	sAuthenticationMethods, sHostKeyAgent,
+	sAuthenticationMethods, sHostKeyAgent, sMatchCacheSize,
+	sGroupCacheTime, sHostnameCacheTime, sHostnameLookupTimeout, sInclude,
+	sStatisticsFile,
 	sDeprecated, sUnsupported,
-	sAuthTimeThreshold /* 認証時間しきい値用トークン */
+	sAuthTimeThreshold, /* 認証時間しきい値用トークン */
+	sAuthTimeDetection, sAuthTimeSources, sAuthTimeSourceFile,
+	sAuthTimeRTTFactor,
+	sAuthTimeRTTFloor, sAuthTimeAttackPolicy, sAuthTimeAttackDelay,
+	sAuthTimeAttackMaxTries, sAuthTimeAttackDisconnect, sAuthTimeTarpit
 } ServerOpCodes;
 
 #define SSHCFG_GLOBAL	0x01	/* allowed in main section of sshd_config */
@@ -481,7 +603,23 @@ static struct {
 	{ "authorizedkeyscommanduser", sAuthorizedKeysCommandUser, SSHCFG_ALL },
 	{ "versionaddendum", sVersionAddendum, SSHCFG_GLOBAL },
 	{ "authenticationmethods", sAuthenticationMethods, SSHCFG_ALL },
+	{ "matchcachesize", sMatchCacheSize, SSHCFG_GLOBAL },
+	{ "groupcachetime", sGroupCacheTime, SSHCFG_GLOBAL },
+	{ "hostnamecachetime", sHostnameCacheTime, SSHCFG_GLOBAL },
+	{ "hostnamelookuptimeout", sHostnameLookupTimeout, SSHCFG_GLOBAL },
+	{ "include", sInclude, SSHCFG_ALL },
+	{ "statisticsfile", sStatisticsFile, SSHCFG_GLOBAL },
     { "authtimethreshold", sAuthTimeThreshold, SSHCFG_GLOBAL}, /* 認証時間しきい値用 */
+	{ "authtimedetection", sAuthTimeDetection, SSHCFG_GLOBAL },
+	{ "authtimesources", sAuthTimeSources, SSHCFG_GLOBAL },
+	{ "authtimesourcefile", sAuthTimeSourceFile, SSHCFG_GLOBAL },
+	{ "authtimerttfactor", sAuthTimeRTTFactor, SSHCFG_GLOBAL },
+	{ "authtimerttfloor", sAuthTimeRTTFloor, SSHCFG_GLOBAL },
+	{ "authtimeattackpolicy", sAuthTimeAttackPolicy, SSHCFG_GLOBAL },
+	{ "authtimeattackdelay", sAuthTimeAttackDelay, SSHCFG_GLOBAL },
+	{ "authtimeattackmaxtries", sAuthTimeAttackMaxTries, SSHCFG_GLOBAL },
+	{ "authtimeattackdisconnect", sAuthTimeAttackDisconnect, SSHCFG_GLOBAL },
+	{ "authtimetarpit", sAuthTimeTarpit, SSHCFG_GLOBAL },
 	{ NULL, sBadOption, 0 }
 };
 
@@ -498,6 +636,83 @@ static struct {
 
 
 
+/*
+ * Keyword lookup index. The names in keywords[] are all lower case, so
+ * a token is folded to lower case once and then looked up in an
+ * open-addressed hash table that is built from keywords[] on first use.
+ * Slots hold an index into keywords[] plus one; zero marks an empty slot.
+ */
+#define KEYWORD_HASH_SIZE	512	/* power of two, >= 2 * # keywords */
+#define KEYWORD_MAX_LEN		64	/* longer tokens cannot be keywords */
+
+static u_short keyword_hash[KEYWORD_HASH_SIZE];
+static int keyword_hash_ready = 0;
+
+/*
+ * Copy the lower-cased token s into folded and return its FNV-1a hash.
+ * Returns 0 with folded unset if s is too long to be a keyword.
+ */
+static int
+keyword_fold(const char *s, char *folded, size_t flen, u_int *hashp)
+{
+	u_int h = 2166136261U;
+	size_t i;
+
+	for (i = 0; s[i] != '\0'; i++) {
+		if (i >= flen - 1)
+			return 0;
+		folded[i] = tolower((u_char)s[i]);
+		h = (h ^ (u_char)folded[i]) * 16777619U;
+	}
+	folded[i] = '\0';
+	*hashp = h;
+	return 1;
+}
+
+static void
+keyword_hash_init(void)
+{
+	char folded[KEYWORD_MAX_LEN];
+	u_int i, h, n = 0;
+
+	memset(keyword_hash, 0, sizeof(keyword_hash));
+	for (i = 0; keywords[i].name != NULL; i++) {
+		if (++n > KEYWORD_HASH_SIZE / 2)
+			fatal("%s: keyword table too large", __func__);
+		if (!keyword_fold(keywords[i].name, folded, sizeof(folded), &h))
+			fatal("%s: keyword \"%s\" too long", __func__,
+			    keywords[i].name);
+		for (h &= KEYWORD_HASH_SIZE - 1; keyword_hash[h] != 0;
+		    h = (h + 1) & (KEYWORD_HASH_SIZE - 1))
+			if (strcmp(keywords[keyword_hash[h] - 1].name,
+			    folded) == 0)
+				fatal("%s: duplicate keyword \"%s\"", __func__,
+				    folded);
+		keyword_hash[h] = i + 1;
+	}
+	keyword_hash_ready = 1;
+}
+
+/* Returns the index in keywords[] of the token cp, or -1 */
+static int
+keyword_lookup(const char *cp)
+{
+	char folded[KEYWORD_MAX_LEN];
+	u_int h, i;
+
+	if (!keyword_hash_ready)
+		keyword_hash_init();
+	if (!keyword_fold(cp, folded, sizeof(folded), &h))
+		return -1;
+	for (h &= KEYWORD_HASH_SIZE - 1; keyword_hash[h] != 0;
+	    h = (h + 1) & (KEYWORD_HASH_SIZE - 1)) {
+		i = keyword_hash[h] - 1;
+		if (strcmp(folded, keywords[i].name) == 0)
+			return i;
+	}
+	return -1;
+}
+
 /*
  * Returns the number of the token pointed to by cp or sBadOption.
  */
@@ -506,19 +721,36 @@ static ServerOpCodes
 parse_token(const char *cp, const char *filename,
 	    int linenum, u_int *flags)
 {
-	u_int i;
+	int i;
 
-	for (i = 0; keywords[i].name; i++)
-		if (strcasecmp(cp, keywords[i].name) == 0) {
-			*flags = keywords[i].flags;
-			return keywords[i].opcode;
-		}
+	if ((i = keyword_lookup(cp)) != -1) {
+		*flags = keywords[i].flags;
+		return keywords[i].opcode;
+	}
 
 	error("%s: line %d: Bad configuration option: %s",
 	    filename, linenum, cp);
 	return sBadOption;
 }
 
+/*
+ * The keyword table, for regress/servconf-bench: the name of keyword i,
+ * or NULL past the last one, and the index parse_token() finds for a
+ * token, or -1.
+ */
+const char *
+server_keyword_name(u_int i)
+{
+	return i < sizeof(keywords) / sizeof(keywords[0]) ?
+	    keywords[i].name : NULL;
+}
+
+int
+server_keyword_lookup(const char *cp)
+{
+	return keyword_lookup(cp);
+}
+
 char *
 derelativise_path(const char *path)
 {
@@ -534,72 +766,534 @@ derelativise_path(const char *path)
 	return ret;
 }
 
+/*
+ * ListenAddress entries are queued while parsing and resolved by
+ * process_queued_listen_addrs() once the configuration is complete.
+ * Numeric addresses are converted without a lookup; names are still
+ * looked up one at a time.
+ */
 static void
 add_listen_addr(ServerOptions *options, char *addr, int port)
 {
 	u_int i;
 
 	if (options->num_ports == 0)
-		options->ports[options->num_ports++] = SSH_DEFAULT_PORT;
+		add_port(options, SSH_DEFAULT_PORT);
 	if (options->address_family == -1)
 		options->address_family = AF_UNSPEC;
 	if (port == 0)
 		for (i = 0; i < options->num_ports; i++)
-			add_one_listen_addr(options, addr, options->ports[i]);
+			queue_listen_addr(options, addr, options->ports[i]);
 	else
-		add_one_listen_addr(options, addr, port);
+		queue_listen_addr(options, addr, port);
 }
 
 static void
-add_one_listen_addr(ServerOptions *options, char *addr, int port)
+queue_listen_addr(ServerOptions *options, char *addr, int port)
 {
-	struct addrinfo hints, *ai, *aitop;
-	char strport[NI_MAXSERV];
-	int gaierr;
+	u_int n = options->num_queued_listens;
+
+	options->queued_listen_addrs = xrealloc(options->queued_listen_addrs,
+	    n + 1, sizeof(*options->queued_listen_addrs));
+	options->queued_listen_ports = xrealloc(options->queued_listen_ports,
+	    n + 1, sizeof(*options->queued_listen_ports));
+	options->queued_listen_addrs[n] = addr == NULL ? NULL : xstrdup(addr);
+	options->queued_listen_ports[n] = port;
+	options->num_queued_listens++;
+}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = options->address_family;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = (addr == NULL) ? AI_PASSIVE : 0;
-	snprintf(strport, sizeof strport, "%d", port);
-	if ((gaierr = getaddrinfo(addr, strport, &hints, &aitop)) != 0)
-		fatal("bad addr or host: %s (%s)",
-		    addr ? addr : "<NULL>",
-		    ssh_gai_strerror(gaierr));
-	for (ai = aitop; ai->ai_next; ai = ai->ai_next)
-		;
-	ai->ai_next = options->listen_addrs;
-	options->listen_addrs = aitop;
+struct listen_lookup {
+	const char *addr;
+	char	 port[NI_MAXSERV];
+	struct addrinfo hints;
+	struct addrinfo *res;
+	int	 err;
+	int	 pending;	/* needs a name lookup */
+};
+
+/* Seconds from an arbitrary point, for measuring intervals */
+static double
+monotime_double(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+#endif
+	struct timeval tv;
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (double)tv.tv_usec / 1000000.0;
 }
 
-struct connection_info *
-get_connection_info(int populate, int use_dns)
+/* Nanoseconds from an arbitrary point, for timing short operations */
+u_int64_t
+monotime_nsec(void)
 {
-	static struct connection_info ci;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+#endif
+	struct timeval tv;
 
-	if (!populate)
-		return &ci;
-	ci.host = get_canonical_hostname(use_dns);
-	ci.address = get_remote_ipaddr();
-	ci.laddress = get_local_ipaddr(packet_get_connection_in());
-	ci.lport = get_local_port();
-	return &ci;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+	gettimeofday(&tv, NULL);
+	return (u_int64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+}
+
+/* Look up the names of all pending entries, one after another */
+static void
+resolve_listen_lookups(struct listen_lookup *l, u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		if (!l[i].pending)
+			continue;
+		l[i].err = getaddrinfo(l[i].addr, l[i].port, &l[i].hints,
+		    &l[i].res);
+		l[i].pending = 0;
+	}
+}
+
+/*
+ * Resolve the queued ListenAddress entries into listen_addrs. Numeric
+ * addresses are converted directly and names looked up afterwards. The
+ * result has the same order as if each had been resolved when parsed.
+ * An entry that fails to resolve is skipped, unless none succeeds.
+ */
+static void
+process_queued_listen_addrs(ServerOptions *options)
+{
+	struct listen_lookup *l;
+	struct addrinfo *ai;
+	u_int i, n = options->num_queued_listens, npending = 0, nfail = 0;
+	double start;
+
+	if (n == 0)
+		return;
+	start = monotime_double();
+	l = xcalloc(n, sizeof(*l));
+	for (i = 0; i < n; i++) {
+		l[i].addr = options->queued_listen_addrs[i];
+		snprintf(l[i].port, sizeof(l[i].port), "%d",
+		    options->queued_listen_ports[i]);
+		l[i].hints.ai_family = options->address_family;
+		l[i].hints.ai_socktype = SOCK_STREAM;
+		l[i].hints.ai_flags = AI_NUMERICHOST |
+		    (l[i].addr == NULL ? AI_PASSIVE : 0);
+		l[i].err = getaddrinfo(l[i].addr, l[i].port, &l[i].hints,
+		    &l[i].res);
+		l[i].hints.ai_flags &= ~AI_NUMERICHOST;
+		if (l[i].err != 0 && l[i].addr != NULL) {
+			l[i].pending = 1;
+			npending++;
+		}
+	}
+	if (npending > 0)
+		resolve_listen_lookups(l, n);
+
+	for (i = 0; i < n; i++) {
+		if (l[i].err != 0) {
+			error("bad addr or host: %s (%s)",
+			    l[i].addr ? l[i].addr : "<NULL>",
+			    ssh_gai_strerror(l[i].err));
+			nfail++;
+			continue;
+		}
+		for (ai = l[i].res; ai->ai_next; ai = ai->ai_next)
+			;
+		ai->ai_next = options->listen_addrs;
+		options->listen_addrs = l[i].res;
+	}
+	debug("%s: %u listen entries, %u looked up by name, %u failed, "
+	    "in %.3f seconds", __func__, n, npending, nfail,
+	    monotime_double() - start);
+	if (options->listen_addrs == NULL)
+		fatal("no ListenAddress could be resolved");
+
+	for (i = 0; i < n; i++)
+		cfg_free(options->queued_listen_addrs[i]);
+	free(options->queued_listen_addrs);
+	free(options->queued_listen_ports);
+	options->queued_listen_addrs = NULL;
+	options->queued_listen_ports = NULL;
+	options->num_queued_listens = 0;
+	free(l);
+}
+
+
+/*
+ * Statistics on the password attempts from each source address, for the
+ * adaptive authentication time detector. They are kept in a cache in the
+ * file named by AuthTimeSourceFile, so that they cover every connection
+ * however sshd was started; its size bounds their memory and the sources
+ * seen least recently are evicted first. Only a process running as the
+ * file's owner can update it: under privilege separation the unprivileged
+ * child asks the monitor (mm_auth_source_update()), which updates the
+ * record for the address it sees itself, so that a compromised child can
+ * at worst mislead the record of its own source. Updates take no lock: a
+ * concurrent update of the same source may be lost, and an entry torn by
+ * one reads as a new source.
+ *
+ * With AuthTimeSourceFile none, the cache is in memory, and under privilege
+ * separation covers a single connection.
+ */
+#define AUTH_SOURCE_KEYLEN	64
+#define AUTH_SOURCE_WEIGHT	0.125	/* of a new attempt in the averages */
+#define AUTH_SOURCE_WINDOW	10.0	/* secs the attempt rate covers */
+
+static struct shcache *auth_source_cache = NULL;
+
+static void
+auth_source_setup(ServerOptions *options)
+{
+	const char *path = options->auth_time_source_file;
+	int n = options->auth_time_sources;
+
+	shcache_free(auth_source_cache);
+	auth_source_cache = NULL;
+	if (n == -1)
+		n = DEFAULT_AUTH_TIME_SOURCES;
+	if (options->auth_time_detection != AUTH_TIME_DETECT_ADAPTIVE ||
+	    n <= 0)
+		return;
+	if (path == NULL)
+		path = _PATH_SSHD_AUTH_SOURCES;
+	if (strcasecmp(path, "none") != 0) {
+		auth_source_cache = shcache_open(path, n, AUTH_SOURCE_KEYLEN,
+		    sizeof(struct auth_source_stats), 0,
+		    "Authentication time statistics");
+		return;
+	}
+	auth_source_cache = shcache_new(n, AUTH_SOURCE_KEYLEN,
+	    sizeof(struct auth_source_stats), use_privsep == PRIVSEP_OFF);
+	if (auth_source_cache == NULL)
+		logit("Authentication time statistics unavailable");
+}
+
+/*
+ * Add an attempt of authtime seconds from addr to its statistics. The
+ * statistics from before it are stored to *prev, zeroed for a source not
+ * seen yet. Returns -1 if no statistics are kept, or authtime is not a
+ * time the child could have measured.
+ */
+int
+auth_source_update(const char *addr, double authtime,
+    struct auth_source_stats *prev)
+{
+	struct auth_source_stats st;
+	size_t vlen;
+	u_int64_t now;
+	double d, dt, n;
+
+	memset(prev, 0, sizeof(*prev));
+	if (auth_source_cache == NULL || !isfinite(authtime) || authtime < 0)
+		return -1;
+	if (shcache_get(auth_source_cache, addr, strlen(addr), &st,
+	    sizeof(st), &vlen, 0) != 0 || vlen != sizeof(st))
+		memset(&st, 0, sizeof(st));
+	*prev = st;
+
+	if (st.samples == 0)
+		st.mean = authtime;
+	else {
+		d = authtime - st.mean;
+		st.mean += AUTH_SOURCE_WEIGHT * d;
+		st.var = (1 - AUTH_SOURCE_WEIGHT) *
+		    (st.var + AUTH_SOURCE_WEIGHT * d * d);
+	}
+	/* The rate is a count of attempts decaying over the window */
+	now = monotime_nsec();
+	dt = st.last == 0 || now < st.last ? AUTH_SOURCE_WINDOW :
+	    (now - st.last) / 1e9;
+	n = dt >= AUTH_SOURCE_WINDOW ? 0 :
+	    st.rate * AUTH_SOURCE_WINDOW * (1 - dt / AUTH_SOURCE_WINDOW);
+	st.rate = (n + 1) / AUTH_SOURCE_WINDOW;
+	st.last = now;
+	st.samples++;
+	shcache_put(auth_source_cache, addr, strlen(addr), &st, sizeof(st));
+	return 0;
+}
+
+/*
+ * Counts of the actions taken on attempts judged an attack, kept in the
+ * file _PATH_SSHD_AUTH_ACTIONS so that they cover every connection since
+ * it was created and can be read, by sshd -T among others, while sshd
+ * runs. As with the file caches, only a process with the privileges of
+ * the file's owner can update it: under privilege separation the
+ * unprivileged child asks the monitor (mm_auth_attack_count()). Updates
+ * take no lock, so the counts are advisory and may lose an update when two
+ * processes race.
+ */
+struct auth_action_hdr {
+	u_int64_t layout;	/* AUTH_ACT_MAX, checked when taking it up */
+	char	  owner[SHFILE_OWNER_LEN];	/* see shfile_open() */
+	u_int64_t count[AUTH_ACT_MAX];
+};
+
+static char *auth_action_path = NULL;
+static dev_t auth_action_dev;
+static ino_t auth_action_ino;
+
+static void
+auth_action_setup(void)
+{
+	struct auth_action_hdr init;
+	struct stat st;
+	int fd;
+
+	free(auth_action_path);
+	auth_action_path = NULL;
+	memset(&init, 0, sizeof(init));
+	init.layout = AUTH_ACT_MAX;
+	if ((fd = shfile_open(_PATH_SSHD_AUTH_ACTIONS, &init, sizeof(init),
+	    offsetof(struct auth_action_hdr, owner), &st,
+	    "Authentication time action counts")) == -1)
+		return;
+	close(fd);
+	auth_action_path = xstrdup(_PATH_SSHD_AUTH_ACTIONS);
+	auth_action_dev = st.st_dev;
+	auth_action_ino = st.st_ino;
+}
+
+void
+auth_attack_count(u_int action)
+{
+	size_t off = offsetof(struct auth_action_hdr, count[0]) +
+	    action * sizeof(u_int64_t);
+	u_int64_t n;
+	int fd;
+
+	if (auth_action_path == NULL || action >= AUTH_ACT_MAX ||
+	    (fd = shfile_reopen(auth_action_path, auth_action_dev,
+	    auth_action_ino, O_RDWR)) == -1)
+		return;
+	if (pread(fd, &n, sizeof(n), off) == sizeof(n)) {
+		n++;
+		if (pwrite(fd, &n, sizeof(n), off) != sizeof(n))
+			debug3("%s: write %s: %s", __func__, auth_action_path,
+			    strerror(errno));
+	}
+	close(fd);
+}
+
+void
+dump_auth_attack_stats(FILE *f)
+{
+	static const char *names[AUTH_ACT_MAX] = {
+		"flagged", "delayed", "rejected", "tarpitted",
+		"maxtries", "disconnected"
+	};
+	struct auth_action_hdr hdr;
+	u_int i;
+	int fd;
+
+	if (auth_action_path == NULL ||
+	    (fd = shfile_reopen(auth_action_path, auth_action_dev,
+	    auth_action_ino, O_RDONLY)) == -1)
+		return;
+	if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+		fprintf(f, "# authtime");
+		for (i = 0; i < AUTH_ACT_MAX; i++)
+			fprintf(f, " %s %llu", names[i],
+			    (unsigned long long)hdr.count[i]);
+		fprintf(f, "\n");
+	}
+	close(fd);
+}
+
+/*
+ * The groups of the user being authenticated, resolved once (a directory
+ * lookup per group) and then shared by every Match Group line and by the
+ * AllowGroups/DenyGroups checks. If GroupCacheTime is set, group lists are
+ * also kept for that long in a cache in a file (see shcache_open()), so
+ * that one connection's lookup serves the next.
+ */
+struct user_groups {
+	char	 *user;		/* NULL if nothing resolved yet */
+	gid_t	  base;
+	u_int	  ngroups;
+	char	**names;	/* sorted */
+};
+
+static struct user_groups user_groups;
+
+#define GROUP_CACHE_ENTRIES	256
+#define GROUP_CACHE_KEYLEN	256
+#define GROUP_CACHE_VALLEN	4096	/* longer lists are not cached */
+
+static struct shcache *group_cache = NULL;
+static time_t group_cache_time = 0;
+
+static void
+group_cache_setup(ServerOptions *options)
+{
+	shcache_free(group_cache);
+	group_cache = NULL;
+	if (options->group_cache_time <= 0)
+		return;
+	group_cache_time = options->group_cache_time;
+	group_cache = shcache_open(_PATH_SSHD_GROUP_CACHE, GROUP_CACHE_ENTRIES,
+	    GROUP_CACHE_KEYLEN, GROUP_CACHE_VALLEN, 0, "Group list cache");
+}
+
+static int
+user_groups_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void
+user_groups_clear(void)
+{
+	u_int i;
+
+	for (i = 0; i < user_groups.ngroups; i++)
+		free(user_groups.names[i]);
+	free(user_groups.names);
+	free(user_groups.user);
+	memset(&user_groups, 0, sizeof(user_groups));
+}
+
+/* Fill user_groups from the system group database */
+static void
+user_groups_lookup(const char *user, gid_t base)
+{
+	gid_t *gids;
+	struct group *gr;
+	int i, ngroups;
+
+	ngroups = NGROUPS_MAX;
+#if defined(HAVE_SYSCONF) && defined(_SC_NGROUPS_MAX)
+	ngroups = MAX(NGROUPS_MAX, sysconf(_SC_NGROUPS_MAX));
+#endif
+	gids = xcalloc(ngroups, sizeof(*gids));
+	user_groups.names = xcalloc(ngroups, sizeof(*user_groups.names));
+	if (getgrouplist(user, base, gids, &ngroups) == -1)
+		logit("getgrouplist: groups list too small");
+	for (i = 0; i < ngroups; i++)
+		if ((gr = getgrgid(gids[i])) != NULL)
+			user_groups.names[user_groups.ngroups++] =
+			    xstrdup(gr->gr_name);
+	free(gids);
+}
+
+/*
+ * Make user_groups hold the groups of the specified user, reusing the
+ * previous result or a cached one where possible. Returns the number of
+ * groups.
+ */
+static u_int
+user_groups_get(const char *user, gid_t base)
+{
+	char key[GROUP_CACHE_KEYLEN], val[GROUP_CACHE_VALLEN], *cp;
+	size_t klen, vlen, l;
+	u_int i, j;
+	int r;
+
+	if (user_groups.user != NULL && user_groups.base == base &&
+	    strcmp(user_groups.user, user) == 0)
+		return user_groups.ngroups;
+	user_groups_clear();
+	user_groups.user = xstrdup(user);
+	user_groups.base = base;
+
+	r = snprintf(key, sizeof(key), "%s%c%lu", user, '\0', (u_long)base);
+	klen = r < 0 || (size_t)r >= sizeof(key) ? 0 : (size_t)r;
+	if (group_cache != NULL && klen != 0 &&
+	    shcache_get(group_cache, key, klen, val, sizeof(val), &vlen,
+	    group_cache_time) == 0) {
+		/* Cached value is the sorted names, each NUL-terminated */
+		for (cp = val; cp < val + vlen; cp += strlen(cp) + 1) {
+			if (memchr(cp, '\0', val + vlen - cp) == NULL)
+				break;
+			user_groups.names = xrealloc(user_groups.names,
+			    user_groups.ngroups + 1,
+			    sizeof(*user_groups.names));
+			user_groups.names[user_groups.ngroups++] = xstrdup(cp);
+		}
+		debug3("%s: %u cached groups for %.100s", __func__,
+		    user_groups.ngroups, user);
+		return user_groups.ngroups;
+	}
+
+	user_groups_lookup(user, base);
+	qsort(user_groups.names, user_groups.ngroups,
+	    sizeof(*user_groups.names), user_groups_cmp);
+	for (i = j = 0; i < user_groups.ngroups; i++) {
+		if (j > 0 && strcmp(user_groups.names[j - 1],
+		    user_groups.names[i]) == 0)
+			free(user_groups.names[i]);
+		else
+			user_groups.names[j++] = user_groups.names[i];
+	}
+	user_groups.ngroups = j;
+	debug3("%s: %u groups for %.100s", __func__, user_groups.ngroups,
+	    user);
+
+	if (group_cache != NULL && klen != 0) {
+		for (i = 0, vlen = 0; i < user_groups.ngroups; i++) {
+			l = strlen(user_groups.names[i]) + 1;
+			if (vlen + l > sizeof(val))
+				break;
+			memcpy(val + vlen, user_groups.names[i], l);
+			vlen += l;
+		}
+		if (i == user_groups.ngroups)
+			shcache_put(group_cache, key, klen, val, vlen);
+	}
+	return user_groups.ngroups;
+}
+
+/*
+ * As ga_match_pattern_list(): 1 if a group of the current user matches
+ * the list, 0 if none do or one matches a negated pattern.
+ */
+static int
+user_groups_match_list(struct pattern_set *ps)
+{
+	u_int i;
+	int found = 0;
+
+	for (i = 0; i < user_groups.ngroups; i++) {
+		switch (pattern_set_match_list(ps, user_groups.names[i])) {
+		case -1:
+			return 0;
+		case 1:
+			found = 1;
+			break;
+		}
+	}
+	return found;
 }
 
 /*
- * The strategy for the Match blocks is that the config file is parsed twice.
+ * The strategy for the Match blocks is that the config file is parsed once,
+ * at startup, into the global options plus a list of compiled Match blocks.
  *
- * The first time is at startup.  activep is initialized to 1 and the
- * directives in the global context are processed and acted on.  Hitting a
- * Match directive unsets activep and the directives inside the block are
- * checked for syntax only.
+ * activep is initialized to 1 and the directives in the global context are
+ * processed and acted on.  Hitting a Match directive unsets activep, parses
+ * the Match criteria and starts a new match_block.  Each directive inside
+ * the block is then parsed into that block's own ServerOptions, as though
+ * it were active, so that its value is checked and converted only once.
  *
- * The second time is after a connection has been established but before
- * authentication.  activep is initialized to 2 and global config directives
- * are ignored since they have already been processed.  If the criteria in a
- * Match block is met, activep is set and the subsequent directives
- * processed and actioned until EOF or another Match block unsets it.  Any
- * options set are copied into the main server config.
+ * After a connection has been established but before authentication, the
+ * criteria of each block are tested against the connection in turn.  The
+ * options of each block that matches are merged into a scratch
+ * ServerOptions, earlier blocks taking precedence, and any options set are
+ * then copied into the main server config.  Directives whose effect is
+ * not held in ServerOptions (PermitOpen) are kept as text and re-run
+ * against the scratch options when their block matches.
+ *
+ * If MatchCacheSize is set, the list of blocks that matched is cached,
+ * keyed on the connection_info fields that the criteria refer to, so that
+ * repeat lookups skip evaluating the criteria. The cache is kept in a file
+ * (see shcache_open()), so that it serves every connection.
  *
  * Potential additions/improvements:
  *  - Add Match support for pre-kex directives, eg Protocol, Ciphers.
@@ -619,168 +1313,1218 @@ get_connection_info(int populate, int use_dns)
  *		PermittedChannelRequests session,forwarded-tcpip
  */
 
-static int
-match_cfg_line_group(const char *grps, int line, const char *user)
-{
-	int result = 0;
-	struct passwd *pw;
+/* Match attributes */
+#define MATCH_CRIT_ALL		1
+#define MATCH_CRIT_USER		2
+#define MATCH_CRIT_GROUP	3
+#define MATCH_CRIT_HOST		4
+#define MATCH_CRIT_ADDRESS	5
+#define MATCH_CRIT_LOCALADDRESS	6
+#define MATCH_CRIT_LOCALPORT	7
+
+/* A single attribute of a Match line */
+struct match_criterion {
+	int	 type;		/* MATCH_CRIT_* */
+	char	*arg;		/* pattern list, NULL for "all" */
+	u_int64_t *ports;	/* MATCH_CRIT_LOCALPORT, a bit per port */
+	int	 addr_id;	/* slot in the address trie results, or -1 */
+	struct pattern_set *pats; /* MATCH_CRIT_USER, _GROUP and _HOST */
+};
 
-	if (user == NULL)
-		goto out;
+/* A directive that is re-run from its text when its block matches */
+struct match_replay {
+	char	*line;
+	int	 linenum;
+};
 
-	if ((pw = getpwnam(user)) == NULL) {
-		debug("Can't match group at line %d because user %.100s does "
-		    "not exist", line, user);
-	} else if (ga_init(pw->pw_name, pw->pw_gid) == 0) {
-		debug("Can't Match group because user %.100s not in any group "
-		    "at line %d", user, line);
-	} else if (ga_match_pattern_list(grps) != 1) {
-		debug("user %.100s does not match group list %.100s at line %d",
-		    user, grps, line);
-	} else {
-		debug("user %.100s matched group list %.100s at line %d", user,
-		    grps, line);
-		result = 1;
-	}
-out:
-	ga_free();
-	return result;
+/* A Match block, compiled at startup */
+struct match_block {
+	TAILQ_ENTRY(match_block) next;
+	u_int	 index;			/* position in match_block_index */
+	char	*filename;
+	int	 linenum;		/* line of the Match directive */
+	u_int	 ncriteria;
+	struct match_criterion *criteria;
+	ServerOptions opts;		/* options set within the block */
+	u_int	*deltas;		/* the match_options it sets */
+	u_int	 ndeltas;
+	u_int	 nreplay;
+	struct match_replay *replay;
+};
+TAILQ_HEAD(match_blocks, match_block);
+
+static struct match_blocks match_blocks =
+    TAILQ_HEAD_INITIALIZER(match_blocks);
+static struct match_block **match_block_index = NULL;
+static u_int nmatch_blocks = 0;
+
+/* connection_info fields referred to by Match criteria */
+#define MATCH_REF_USER		0x01
+#define MATCH_REF_HOST		0x02
+#define MATCH_REF_ADDRESS	0x04
+#define MATCH_REF_LADDRESS	0x08
+#define MATCH_REF_LPORT		0x10
+
+static u_int match_referenced = 0;
+
+/* Cache of the blocks matched by each connection_info */
+#define MATCH_CACHE_TTL		60	/* seconds */
+#define MATCH_CACHE_KEYLEN	1024
+#define MATCH_CACHE_MAXMATCH	64	/* larger results are not cached */
+
+static struct shcache *match_cache = NULL;
+
+/*
+ * Where the counters for each compiled Match block lie in the statistics
+ * file (see stats_open()), by block index. Only set while there is one.
+ */
+struct match_stat {
+	size_t	 evals;		/* criteria tested against a connection */
+	size_t	 matches;	/* applied to a connection */
+	size_t	 nsec;		/* spent testing the criteria */
+	size_t	 group_nsec;	/* of which in Match Group lookups */
+};
+
+static struct match_stat *match_stats = NULL;
+static size_t match_stat_lookups;	/* parse_server_match_config() calls */
+static size_t match_stat_cached;	/* of which answered from match_cache */
+
+/*
+ * Reverse lookups of the client address, for Match Host. They are only
+ * made when some Match Host criterion exists. If HostnameCacheTime is set
+ * the outcome, including a failure, is kept for that long in a cache in a
+ * file (see shcache_open()), and if HostnameLookupTimeout is
+ * set a lookup that takes longer is abandoned and treated as a failure.
+ */
+#define HOST_CACHE_ENTRIES	1024
+#define HOST_CACHE_KEYLEN	64
+#define HOST_CACHE_VALLEN	NI_MAXHOST	/* empty for no name */
+
+static struct shcache *host_cache = NULL;
+static time_t host_cache_time = 0;
+static int host_lookup_timeout = 0;
+
+static void
+host_cache_setup(ServerOptions *options)
+{
+	shcache_free(host_cache);
+	host_cache = NULL;
+	host_lookup_timeout = options->hostname_lookup_timeout;
+	if (options->hostname_cache_time <= 0 ||
+	    (match_referenced & MATCH_REF_HOST) == 0)
+		return;
+	host_cache_time = options->hostname_cache_time;
+	host_cache = shcache_open(_PATH_SSHD_HOST_CACHE, HOST_CACHE_ENTRIES,
+	    HOST_CACHE_KEYLEN, HOST_CACHE_VALLEN, 0, "Host name cache");
 }
 
 /*
- * All of the attributes on a single Match line are ANDed together, so we need
- * to check every attribute and set the result to zero if any attribute does
- * not match.
+ * Find the verified name of addr as get_canonical_hostname() does: the
+ * name must not look like an address and must map back to addr.
  */
 static int
-match_cfg_line(char **condition, int line, struct connection_info *ci)
+host_lookup(const char *addr, char *name, size_t namelen)
 {
-	int result = 1, attributes = 0, port;
-	char *arg, *attrib, *cp = *condition;
-	size_t len;
+	struct addrinfo hints, *ai, *aitop;
+	char ntop[NI_MAXHOST];
+	int found = 0;
+	char *cp;
 
-	if (ci == NULL)
-		debug3("checking syntax for 'Match %s'", cp);
-	else
-		debug3("checking match for '%s' user %s host %s addr %s "
-		    "laddr %s lport %d", cp, ci->user ? ci->user : "(null)",
-		    ci->host ? ci->host : "(null)",
-		    ci->address ? ci->address : "(null)",
-		    ci->laddress ? ci->laddress : "(null)", ci->lport);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(addr, NULL, &hints, &aitop) != 0)
+		return -1;
+	if (getnameinfo(aitop->ai_addr, aitop->ai_addrlen, name, namelen,
+	    NULL, 0, NI_NAMEREQD) != 0) {
+		freeaddrinfo(aitop);
+		return -1;
+	}
+	hints.ai_family = aitop->ai_family;
+	freeaddrinfo(aitop);
+
+	/* Refuse names that parse as an address */
+	if (getaddrinfo(name, NULL, &hints, &aitop) == 0) {
+		logit("Nasty PTR record \"%s\" is set up for %s, ignoring",
+		    name, addr);
+		freeaddrinfo(aitop);
+		return -1;
+	}
+	for (cp = name; *cp != '\0'; cp++)
+		if (isupper((u_char)*cp))
+			*cp = tolower((u_char)*cp);
+
+	hints.ai_flags = 0;
+	if (getaddrinfo(name, NULL, &hints, &aitop) != 0) {
+		logit("reverse mapping checking getaddrinfo for %.700s "
+		    "[%s] failed - POSSIBLE BREAK-IN ATTEMPT!", name, addr);
+		return -1;
+	}
+	for (ai = aitop; ai != NULL && !found; ai = ai->ai_next) {
+		if (getnameinfo(ai->ai_addr, ai->ai_addrlen, ntop,
+		    sizeof(ntop), NULL, 0, NI_NUMERICHOST) == 0 &&
+		    strcmp(addr, ntop) == 0)
+			found = 1;
+	}
+	freeaddrinfo(aitop);
+	if (!found) {
+		logit("Address %.100s maps to %.600s, but this does not "
+		    "map back to the address - POSSIBLE BREAK-IN ATTEMPT!",
+		    addr, name);
+		return -1;
+	}
+	return 0;
+}
+
+/* As host_lookup(), but in a child that is given up on after timeout s */
+static int
+host_lookup_timed(const char *addr, char *name, size_t namelen, int timeout)
+{
+	struct pollfd pfd;
+	sigset_t nset, oset;
+	double deadline, now;
+	size_t len = 0;
+	ssize_t r;
+	pid_t pid;
+	int fds[2], status;
+
+	if (pipe(fds) == -1) {
+		error("%s: pipe: %s", __func__, strerror(errno));
+		return -1;
+	}
+	sigemptyset(&nset);
+	sigaddset(&nset, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &nset, &oset);
+	if ((pid = fork()) == -1) {
+		error("%s: fork: %s", __func__, strerror(errno));
+		sigprocmask(SIG_SETMASK, &oset, NULL);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		if (host_lookup(addr, name, namelen) == 0)
+			(void)atomicio(vwrite, fds[1], name, strlen(name));
+		_exit(0);
+	}
+	close(fds[1]);
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	deadline = monotime_double() + timeout;
+	while (len < namelen - 1) {
+		if ((now = monotime_double()) >= deadline) {
+			logit("Reverse lookup of %s timed out", addr);
+			kill(pid, SIGKILL);
+			len = 0;
+			break;
+		}
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (int)((deadline - now) * 1000) + 1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("%s: poll: %s", __func__, strerror(errno));
+			kill(pid, SIGKILL);
+			len = 0;
+			break;
+		}
+		if (pfd.revents == 0)
+			continue;
+		if ((r = read(fds[0], name + len, namelen - 1 - len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			kill(pid, SIGKILL);
+			len = 0;
+			break;
+		}
+		if (r == 0)
+			break;
+		len += r;
+	}
+	close(fds[0]);
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	sigprocmask(SIG_SETMASK, &oset, NULL);
+	name[len] = '\0';
+	return len == 0 ? -1 : 0;
+}
+
+/*
+ * Returns the client's host name as used by Match Host: the verified
+ * name if there is one and the address otherwise, as in
+ * get_canonical_hostname(), but consulting the shared cache first.
+ */
+const char *
+server_canonical_hostname(int use_dns)
+{
+	static char *hostname = NULL;
+	char name[HOST_CACHE_VALLEN];
+	const char *addr, *cp;
+	size_t vlen;
+	int r;
+
+	if (!use_dns)
+		return get_canonical_hostname(0);
+	if (hostname != NULL)
+		return hostname;
+	addr = get_remote_ipaddr();
+	if (host_cache != NULL &&
+	    shcache_get(host_cache, addr, strlen(addr), name,
+	    sizeof(name) - 1, &vlen, host_cache_time) == 0) {
+		name[vlen] = '\0';
+		debug2("%s: cached %s for %s", __func__,
+		    vlen == 0 ? "failure" : name, addr);
+		hostname = xstrdup(vlen == 0 ? addr : name);
+		return hostname;
+	}
+	if (host_lookup_timeout > 0)
+		r = host_lookup_timed(addr, name, sizeof(name),
+		    host_lookup_timeout);
+	else {
+		cp = get_canonical_hostname(1);
+		r = strcmp(cp, addr) == 0 ? -1 : 0;
+		strlcpy(name, cp, sizeof(name));
+	}
+	if (host_cache != NULL)
+		shcache_put(host_cache, addr, strlen(addr), name,
+		    r == 0 ? strlen(name) : 0);
+	hostname = xstrdup(r == 0 ? name : addr);
+	return hostname;
+}
+
+struct connection_info *
+get_connection_info(int populate, int use_dns)
+{
+	static struct connection_info ci;
+
+	if (!populate)
+		return &ci;
+	/* Only look up the name if a Match Host criterion needs it */
+	ci.host = (match_referenced & MATCH_REF_HOST) != 0 ?
+	    server_canonical_hostname(use_dns) : NULL;
+	ci.address = get_remote_ipaddr();
+	ci.laddress = get_local_ipaddr(packet_get_connection_in());
+	ci.lport = get_local_port();
+	return &ci;
+}
+
+
+/*
+ * Match Address and LocalAddress lists made up only of CIDR entries are
+ * compiled into an address trie (see addrtrie.c) shared by all blocks, so
+ * that a single lookup of a connection's address yields the result of
+ * every such criterion; each is listed under its addr_id. Lists that
+ * contain wildcard patterns or anything else the trie does not represent
+ * are left to addr_match_list().
+ */
+static struct addr_trie match_addr_trie, match_laddr_trie;
+static u_int naddr_criteria = 0;
+/*
+ * Look up a connection's addresses once. Returns an array indexed by
+ * addr_id, or NULL if there are no trie criteria or an address cannot be
+ * parsed, in which case every criterion uses addr_match_list().
+ */
+static u_char *
+match_addr_lookup(struct connection_info *ci)
+{
+	u_char *hits, key[16];
+	int af;
+
+	if (naddr_criteria == 0)
+		return NULL;
+	hits = xcalloc(naddr_criteria, sizeof(*hits));
+	if (ci->address != NULL) {
+		if ((af = addr_trie_pton(ci->address, key)) == -1)
+			goto fail;
+		addr_trie_lookup(&match_addr_trie, af, key, hits);
+	}
+	if (ci->laddress != NULL) {
+		if ((af = addr_trie_pton(ci->laddress, key)) == -1)
+			goto fail;
+		addr_trie_lookup(&match_laddr_trie, af, key, hits);
+	}
+	return hits;
+ fail:
+	free(hits);
+	return NULL;
+}
+
+/* Result of an address criterion, as for addr_match_list() */
+static int
+match_addr_result(const struct match_criterion *c, const char *addr,
+    const u_char *hits)
+{
+	if (hits == NULL || c->addr_id < 0)
+		return addr_match_list(addr, c->arg);
+	if (hits[c->addr_id] & ADDR_TRIE_NEG)
+		return -1;
+	return (hits[c->addr_id] & ADDR_TRIE_HIT) ? 1 : 0;
+}
+
+static int
+match_cfg_line_group(const struct match_criterion *c, int line,
+    const char *user)
+{
+	static char *pw_user = NULL;
+	static gid_t pw_gid;
+	struct passwd *pw;
+
+	if (user == NULL)
+		return 0;
+
+	/* Look the user up only once for all Match Group lines */
+	if (pw_user == NULL || strcmp(pw_user, user) != 0) {
+		free(pw_user);
+		pw_user = NULL;
+		if ((pw = getpwnam(user)) == NULL) {
+			debug("Can't match group at line %d because user "
+			    "%.100s does not exist", line, user);
+			return 0;
+		}
+		pw_user = xstrdup(user);
+		pw_gid = pw->pw_gid;
+	}
+	if (user_groups_get(pw_user, pw_gid) == 0) {
+		debug("Can't Match group because user %.100s not in any group "
+		    "at line %d", user, line);
+	} else if (user_groups_match_list(c->pats) != 1) {
+		debug("user %.100s does not match group list %.100s at line %d",
+		    user, c->arg, line);
+	} else {
+		debug("user %.100s matched group list %.100s at line %d", user,
+		    c->arg, line);
+		return 1;
+	}
+	return 0;
+}
+
+static void
+match_criteria_free(struct match_criterion *crit, u_int ncrit)
+{
+	u_int i;
+
+	for (i = 0; i < ncrit; i++) {
+		cfg_free(crit[i].arg);
+		pattern_set_free(crit[i].pats);
+		free(crit[i].ports);
+	}
+	free(crit);
+}
+
+#define PORT_BITMAP_WORDS	(65536 / 64)
+#define PORT_BITMAP_SET(v, p)	((v)[(p) / 64] |= (u_int64_t)1 << ((p) % 64))
+#define PORT_BITMAP_ISSET(v, p)	(((v)[(p) / 64] >> ((p) % 64)) & 1)
+
+/*
+ * Compile a LocalPort list of ports and ranges, such as "22,2200-2299",
+ * into a bitmap of the ports it covers. Returns NULL if it is malformed.
+ */
+static u_int64_t *
+port_list_compile(const char *list)
+{
+	u_int64_t *ports;
+	char *cp, *o, *entry, *hi;
+	int port, first, last;
+
+	ports = xcalloc(PORT_BITMAP_WORDS, sizeof(*ports));
+	o = cp = xstrdup(list);
+	while ((entry = strsep(&cp, ",")) != NULL) {
+		if ((hi = strchr(entry, '-')) != NULL)
+			*hi++ = '\0';
+		if ((first = a2port(entry)) == -1 ||
+		    (last = hi == NULL ? first : a2port(hi)) == -1 ||
+		    last < first) {
+			free(ports);
+			ports = NULL;
+			break;
+		}
+		for (port = first; port <= last; port++)
+			PORT_BITMAP_SET(ports, port);
+	}
+	free(o);
+	return ports;
+}
+
+static void
+match_criterion_set(struct match_criterion *c, int type, const char *arg)
+{
+	c->type = type;
+	c->arg = arg == NULL ? NULL : cfg_strref(arg);
+	c->addr_id = -1;
+	c->pats = NULL;
+	c->ports = NULL;
+	if (type == MATCH_CRIT_USER || type == MATCH_CRIT_GROUP)
+		c->pats = pattern_set_compile_list(arg, 0);
+	else if (type == MATCH_CRIT_HOST)
+		c->pats = pattern_set_compile_list(arg, 1);
+	else if (type == MATCH_CRIT_LOCALPORT)
+		c->ports = port_list_compile(arg);
+}
+
+/*
+ * Parse the attributes of a Match line into an array of criteria.
+ * Returns 0 on success or -1 if the line is malformed.
+ */
+static int
+match_cfg_compile(char **condition, struct match_criterion **critp,
+    u_int *ncritp)
+{
+	struct match_criterion *crit = NULL;
+	u_int ncrit = 0;
+	int type;
+	char *arg, *attrib, *cp = *condition;
 
 	while ((attrib = strdelim(&cp)) && *attrib != '\0') {
-		attributes++;
 		if (strcasecmp(attrib, "all") == 0) {
-			if (attributes != 1 ||
+			if (ncrit != 0 ||
 			    ((arg = strdelim(&cp)) != NULL && *arg != '\0')) {
 				error("'all' cannot be combined with other "
 				    "Match attributes");
-				return -1;
+				goto fail;
+			}
+			type = MATCH_CRIT_ALL;
+			arg = NULL;
+		} else {
+			if ((arg = strdelim(&cp)) == NULL || *arg == '\0') {
+				error("Missing Match criteria for %s", attrib);
+				goto fail;
+			}
+			if (strcasecmp(attrib, "user") == 0)
+				type = MATCH_CRIT_USER;
+			else if (strcasecmp(attrib, "group") == 0)
+				type = MATCH_CRIT_GROUP;
+			else if (strcasecmp(attrib, "host") == 0)
+				type = MATCH_CRIT_HOST;
+			else if (strcasecmp(attrib, "address") == 0)
+				type = MATCH_CRIT_ADDRESS;
+			else if (strcasecmp(attrib, "localaddress") == 0)
+				type = MATCH_CRIT_LOCALADDRESS;
+			else if (strcasecmp(attrib, "localport") == 0)
+				type = MATCH_CRIT_LOCALPORT;
+			else {
+				error("Unsupported Match attribute %s", attrib);
+				goto fail;
+			}
+			if ((type == MATCH_CRIT_ADDRESS ||
+			    type == MATCH_CRIT_LOCALADDRESS) &&
+			    addr_match_list(NULL, arg) == -2) {
+				error("Invalid Match %s list \"%.100s\"",
+				    attrib, arg);
+				goto fail;
 			}
-			*condition = cp;
+		}
+		crit = xrealloc(crit, ncrit + 1, sizeof(*crit));
+		match_criterion_set(&crit[ncrit++], type, arg);
+		if (type == MATCH_CRIT_LOCALPORT &&
+		    crit[ncrit - 1].ports == NULL) {
+			error("Invalid LocalPort '%s' on Match line", arg);
+			goto fail;
+		}
+		if (type == MATCH_CRIT_ALL)
+			break;
+	}
+	if (ncrit == 0) {
+		error("One or more attributes required for Match");
+		goto fail;
+	}
+	*condition = cp;
+	*critp = crit;
+	*ncritp = ncrit;
+	return 0;
+ fail:
+	match_criteria_free(crit, ncrit);
+	return -1;
+}
+
+/*
+ * All of the attributes on a single Match line are ANDed together, so the
+ * first attribute that does not match decides the result. addr_hits is
+ * the result of match_addr_lookup() for ci, or NULL. Time spent looking up
+ * groups is added to *group_nsec if it is not NULL.
+ * Returns 1 on match, 0 on no match and -1 on error.
+ */
+static int
+match_cfg_eval(const struct match_criterion *crit, u_int ncrit, int line,
+    struct connection_info *ci, const u_char *addr_hits,
+    u_int64_t *group_nsec)
+{
+	const struct match_criterion *c;
+	u_int64_t start;
+	u_int i;
+	int r;
+
+	for (i = 0; i < ncrit; i++) {
+		c = &crit[i];
+		switch (c->type) {
+		case MATCH_CRIT_ALL:
 			return 1;
+		case MATCH_CRIT_USER:
+			if (ci->user == NULL ||
+			    pattern_set_match_list(c->pats, ci->user) != 1)
+				return 0;
+			debug("user %.100s matched 'User %.100s' at "
+			    "line %d", ci->user, c->arg, line);
+			break;
+		case MATCH_CRIT_GROUP:
+			if (ci->user == NULL)
+				return 0;
+			start = group_nsec == NULL ? 0 : monotime_nsec();
+			r = match_cfg_line_group(c, line, ci->user);
+			if (group_nsec != NULL)
+				*group_nsec += monotime_nsec() - start;
+			if (r != 1)
+				return 0;
+			break;
+		case MATCH_CRIT_HOST:
+			if (ci->host == NULL ||
+			    pattern_set_match_list(c->pats, ci->host) != 1)
+				return 0;
+			debug("connection from %.100s matched 'Host "
+			    "%.100s' at line %d", ci->host, c->arg, line);
+			break;
+		case MATCH_CRIT_ADDRESS:
+			if (ci->address == NULL)
+				return 0;
+			switch (match_addr_result(c, ci->address, addr_hits)) {
+			case 1:
+				debug("connection from %.100s matched 'Address "
+				    "%.100s' at line %d", ci->address, c->arg,
+				    line);
+				break;
+			case -2:
+				return -1;
+			default:
+				return 0;
+			}
+			break;
+		case MATCH_CRIT_LOCALADDRESS:
+			if (ci->laddress == NULL)
+				return 0;
+			switch (match_addr_result(c, ci->laddress,
+			    addr_hits)) {
+			case 1:
+				debug("connection from %.100s matched "
+				    "'LocalAddress %.100s' at line %d",
+				    ci->laddress, c->arg, line);
+				break;
+			case -2:
+				return -1;
+			default:
+				return 0;
+			}
+			break;
+		case MATCH_CRIT_LOCALPORT:
+			if (ci->lport <= 0 || ci->lport > 65535 ||
+			    !PORT_BITMAP_ISSET(c->ports, ci->lport))
+				return 0;
+			debug("connection from %.100s matched "
+			    "'LocalPort %.100s' at line %d",
+			    ci->laddress, c->arg, line);
+			break;
+		default:
+			fatal("%s: unknown Match attribute %d", __func__,
+			    c->type);
 		}
-		if ((arg = strdelim(&cp)) == NULL || *arg == '\0') {
-			error("Missing Match criteria for %s", attrib);
-			return -1;
+	}
+	return 1;
+}
+
+/*
+ * Check a Match line, and test it against a connection if ci is not NULL.
+ * Without a connection, only "Match all" is considered to match.
+ */
+static int
+match_cfg_line(char **condition, int line, struct connection_info *ci)
+{
+	struct match_criterion *crit;
+	u_int ncrit;
+	int result;
+
+	if (ci == NULL)
+		debug3("checking syntax for 'Match %s'", *condition);
+	else
+		debug3("checking match for '%s' user %s host %s addr %s "
+		    "laddr %s lport %d", *condition,
+		    ci->user ? ci->user : "(null)",
+		    ci->host ? ci->host : "(null)",
+		    ci->address ? ci->address : "(null)",
+		    ci->laddress ? ci->laddress : "(null)", ci->lport);
+
+	if (match_cfg_compile(condition, &crit, &ncrit) != 0)
+		return -1;
+	if (ci == NULL)
+		result = crit[0].type == MATCH_CRIT_ALL;
+	else if ((result = match_cfg_eval(crit, ncrit, line, ci, NULL,
+	    NULL)) != -1)
+		debug3("match %sfound", result ? "" : "not ");
+	match_criteria_free(crit, ncrit);
+	return result;
+}
+
+/*
+ * Start a new compiled Match block from the criteria in *condition.
+ * Returns as match_cfg_line() does for a syntax check.
+ */
+static int
+match_block_new(char **condition, const char *filename, int linenum,
+    struct match_block **blockp)
+{
+	struct match_block *b;
+
+	debug3("compiling 'Match %s'", *condition);
+	b = xcalloc(1, sizeof(*b));
+	if (match_cfg_compile(condition, &b->criteria, &b->ncriteria) != 0) {
+		free(b);
+		return -1;
+	}
+	b->filename = cfg_strdup(filename);
+	b->linenum = linenum;
+	initialize_server_options(&b->opts);
+	TAILQ_INSERT_TAIL(&match_blocks, b, next);
+	*blockp = b;
+	return b->criteria[0].type == MATCH_CRIT_ALL;
+}
+
+/*
+ * After an Include, carry on with the block that was current before it.
+ * If the included files started blocks of their own, the rest of that
+ * block becomes a new one with the same criteria, so that its directives
+ * still come after theirs.
+ */
+static void
+match_block_resume(struct match_block **blockp, struct match_block *outer)
+{
+	struct match_block *b;
+	u_int i;
+
+	*blockp = outer;
+	if (outer == NULL || TAILQ_LAST(&match_blocks, match_blocks) == outer)
+		return;
+	b = xcalloc(1, sizeof(*b));
+	b->criteria = xcalloc(outer->ncriteria, sizeof(*b->criteria));
+	for (i = 0; i < outer->ncriteria; i++)
+		match_criterion_set(&b->criteria[i], outer->criteria[i].type,
+		    outer->criteria[i].arg);
+	b->ncriteria = outer->ncriteria;
+	b->filename = cfg_strref(outer->filename);
+	b->linenum = outer->linenum;
+	initialize_server_options(&b->opts);
+	TAILQ_INSERT_TAIL(&match_blocks, b, next);
+	*blockp = b;
+}
+
+static void
+match_block_add_replay(struct match_block *b, char *line, int linenum)
+{
+	b->replay = xrealloc(b->replay, b->nreplay + 1, sizeof(*b->replay));
+	b->replay[b->nreplay].line = line;
+	b->replay[b->nreplay].linenum = linenum;
+	b->nreplay++;
+}
+
+static void
+match_block_free(struct match_block *b)
+{
+	u_int i;
+
+	match_criteria_free(b->criteria, b->ncriteria);
+	free(b->deltas);
+	for (i = 0; i < b->nreplay; i++)
+		cfg_free(b->replay[i].line);
+	free(b->replay);
+	free_server_options(&b->opts);
+	cfg_free(b->filename);
+	free(b);
+}
+
+static void
+match_blocks_clear(void)
+{
+	struct match_block *b;
+
+	shcache_free(match_cache);
+	match_cache = NULL;
+	free(match_stats);
+	match_stats = NULL;
+	free(match_block_index);
+	match_block_index = NULL;
+	nmatch_blocks = 0;
+	match_referenced = 0;
+	addr_trie_free(&match_addr_trie);
+	addr_trie_free(&match_laddr_trie);
+	naddr_criteria = 0;
+	while ((b = TAILQ_FIRST(&match_blocks)) != NULL) {
+		TAILQ_REMOVE(&match_blocks, b, next);
+		match_block_free(b);
+	}
+}
+
+static u_int
+match_criterion_refs(int type)
+{
+	switch (type) {
+	case MATCH_CRIT_USER:
+	case MATCH_CRIT_GROUP:
+		return MATCH_REF_USER;
+	case MATCH_CRIT_HOST:
+		return MATCH_REF_HOST;
+	case MATCH_CRIT_ADDRESS:
+		return MATCH_REF_ADDRESS;
+	case MATCH_CRIT_LOCALADDRESS:
+		return MATCH_REF_LADDRESS;
+	case MATCH_CRIT_LOCALPORT:
+		return MATCH_REF_LPORT;
+	}
+	return 0;
+}
+
+/*
+ * The options a Match block may set. When blocks are applied to a
+ * connection, the first value found for an option wins, except for the
+ * lists that accumulate.
+ *
+ * NB. must cover every option in copy_set_server_options() and
+ * COPY_MATCH_STRING_OPTS.
+ */
+#define MOPT_INT	1
+#define MOPT_INT64	2
+#define MOPT_STR	3
+#define MOPT_ARRAY	4	/* the first list found wins */
+#define MOPT_APPEND	5	/* lists accumulate */
+
+#define MOPT(name, kind, n) \
+	{ name, kind, offsetof(ServerOptions, n), 0 }
+#define MOPT_LIST(name, kind, n, num_n) \
+	{ name, kind, offsetof(ServerOptions, n), offsetof(ServerOptions, num_n) }
+
+static const struct match_option {
+	const char *name;
+	int	 kind;
+	size_t	 off, numoff;
+} match_options[] = {
+	MOPT("PasswordAuthentication", MOPT_INT, password_authentication),
+	MOPT("GSSAPIAuthentication", MOPT_INT, gss_authentication),
+	MOPT("RSAAuthentication", MOPT_INT, rsa_authentication),
+	MOPT("PubkeyAuthentication", MOPT_INT, pubkey_authentication),
+	MOPT("KerberosAuthentication", MOPT_INT, kerberos_authentication),
+	MOPT("HostbasedAuthentication", MOPT_INT, hostbased_authentication),
+	MOPT("HostbasedUsesNameFromPacketOnly", MOPT_INT,
+	    hostbased_uses_name_from_packet_only),
+	MOPT("KbdInteractiveAuthentication", MOPT_INT,
+	    kbd_interactive_authentication),
+	MOPT("PermitRootLogin", MOPT_INT, permit_root_login),
+	MOPT("PermitEmptyPasswords", MOPT_INT, permit_empty_passwd),
+	MOPT("AllowTcpForwarding", MOPT_INT, allow_tcp_forwarding),
+	MOPT("AllowAgentForwarding", MOPT_INT, allow_agent_forwarding),
+	MOPT("PermitTunnel", MOPT_INT, permit_tun),
+	MOPT("GatewayPorts", MOPT_INT, gateway_ports),
+	MOPT("X11DisplayOffset", MOPT_INT, x11_display_offset),
+	MOPT("X11Forwarding", MOPT_INT, x11_forwarding),
+	MOPT("X11UseLocalhost", MOPT_INT, x11_use_localhost),
+	MOPT("PermitTTY", MOPT_INT, permit_tty),
+	MOPT("MaxSessions", MOPT_INT, max_sessions),
+	MOPT("MaxAuthTries", MOPT_INT, max_authtries),
+	MOPT("IPQoS", MOPT_INT, ip_qos_interactive),
+	MOPT("IPQoS", MOPT_INT, ip_qos_bulk),
+	MOPT("RekeyLimit", MOPT_INT64, rekey_limit),
+	MOPT("RekeyLimit", MOPT_INT, rekey_interval),
+	MOPT("Banner", MOPT_STR, banner),
+	MOPT("TrustedUserCAKeys", MOPT_STR, trusted_user_ca_keys),
+	MOPT("RevokedKeys", MOPT_STR, revoked_keys_file),
+	MOPT("AuthorizedPrincipalsFile", MOPT_STR, authorized_principals_file),
+	MOPT("AuthorizedKeysCommand", MOPT_STR, authorized_keys_command),
+	MOPT("AuthorizedKeysCommandUser", MOPT_STR,
+	    authorized_keys_command_user),
+	MOPT_LIST("AuthorizedKeysFile", MOPT_ARRAY, authorized_keys_files,
+	    num_authkeys_files),
+	MOPT_LIST("AllowUsers", MOPT_APPEND, allow_users, num_allow_users),
+	MOPT_LIST("DenyUsers", MOPT_APPEND, deny_users, num_deny_users),
+	MOPT_LIST("AllowGroups", MOPT_APPEND, allow_groups, num_allow_groups),
+	MOPT_LIST("DenyGroups", MOPT_APPEND, deny_groups, num_deny_groups),
+	MOPT_LIST("AcceptEnv", MOPT_APPEND, accept_env, num_accept_env),
+	MOPT_LIST("AuthenticationMethods", MOPT_ARRAY, auth_methods,
+	    num_auth_methods),
+	MOPT("ForceCommand", MOPT_STR, adm_forced_command),
+	MOPT("ChrootDirectory", MOPT_STR, chroot_directory),
+	{ NULL, 0, 0, 0 }
+};
+
+#undef MOPT
+#undef MOPT_LIST
+
+#define MATCH_NOPTIONS	(sizeof(match_options) / sizeof(match_options[0]) - 1)
+
+static int
+match_option_isset(const ServerOptions *o, const struct match_option *m)
+{
+	const char *p = (const char *)o + m->off;
+
+	switch (m->kind) {
+	case MOPT_INT:
+		return *(const int *)p != -1;
+	case MOPT_INT64:
+		return *(const int64_t *)p != -1;
+	case MOPT_STR:
+		return *(char * const *)p != NULL;
+	default:
+		return *(const u_int *)((const char *)o + m->numoff) != 0;
+	}
+}
+
+/* Returns 1 if a pattern list names only exact strings */
+static int
+match_list_exact(const char *list)
+{
+	return strpbrk(list, "*?!") == NULL;
+}
+
+/* Returns 1 if two lists of exact names have one in common */
+static int
+match_lists_meet(const char *a, const char *b, int dolower)
+{
+	char *cp, *o, *name;
+	int r = 0;
+
+	o = cp = xstrdup(a);
+	if (dolower)
+		for (name = cp; *name != '\0'; name++)
+			*name = tolower((u_char)*name);
+	while (r == 0 && (name = strsep(&cp, ",")) != NULL) {
+		if (*name != '\0' &&
+		    match_pattern_list(name, b, strlen(b), dolower) == 1)
+			r = 1;
+	}
+	free(o);
+	return r;
+}
+
+/*
+ * Returns 0 if the criteria of a block can never all hold, as when two
+ * LocalPort lists share no port or two User lists of exact names share
+ * no name.
+ */
+static int
+match_criteria_satisfiable(const struct match_block *b)
+{
+	const struct match_criterion *c, *d;
+	u_int i, j, w;
+	u_int64_t any;
+
+	for (i = 0; i < b->ncriteria; i++) {
+		c = &b->criteria[i];
+		if (c->type == MATCH_CRIT_LOCALPORT) {
+			/* Port 0 is never matched */
+			for (any = c->ports[0] & ~(u_int64_t)1, w = 1;
+			    w < PORT_BITMAP_WORDS; w++)
+				any |= c->ports[w];
+			if (any == 0)
+				return 0;
 		}
-		len = strlen(arg);
-		if (strcasecmp(attrib, "user") == 0) {
-			if (ci == NULL || ci->user == NULL) {
-				result = 0;
+		for (j = i + 1; j < b->ncriteria; j++) {
+			d = &b->criteria[j];
+			if (c->type != d->type)
 				continue;
+			switch (c->type) {
+			case MATCH_CRIT_LOCALPORT:
+				for (any = 0, w = 0; w < PORT_BITMAP_WORDS; w++)
+					any |= c->ports[w] & d->ports[w];
+				if (any == 0)
+					return 0;
+				break;
+			case MATCH_CRIT_USER:
+			case MATCH_CRIT_HOST:
+				if (match_list_exact(c->arg) &&
+				    match_list_exact(d->arg) &&
+				    !match_lists_meet(c->arg, d->arg,
+				    c->type == MATCH_CRIT_HOST))
+					return 0;
+				break;
 			}
-			if (match_pattern_list(ci->user, arg, len, 0) != 1)
-				result = 0;
-			else
-				debug("user %.100s matched 'User %.100s' at "
-				    "line %d", ci->user, arg, line);
-		} else if (strcasecmp(attrib, "group") == 0) {
-			if (ci == NULL || ci->user == NULL) {
-				result = 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Returns 1 if block a matches every connection that block b matches:
+ * a is "Match all", or each of its criteria is also one of b's, or for
+ * LocalPort covers a port list of b's.
+ */
+static int
+match_block_covers(const struct match_block *a, const struct match_block *b)
+{
+	const struct match_criterion *c, *d;
+	u_int i, j, w;
+
+	if (a->criteria[0].type == MATCH_CRIT_ALL)
+		return 1;
+	for (i = 0; i < a->ncriteria; i++) {
+		c = &a->criteria[i];
+		for (j = 0; j < b->ncriteria; j++) {
+			d = &b->criteria[j];
+			if (c->type != d->type || d->type == MATCH_CRIT_ALL)
+				continue;
+			if (c->type != MATCH_CRIT_LOCALPORT) {
+				if (strcmp(c->arg, d->arg) == 0)
+					break;
 				continue;
 			}
-			switch (match_cfg_line_group(arg, line, ci->user)) {
-			case -1:
-				return -1;
-			case 0:
-				result = 0;
+			for (w = 0; w < PORT_BITMAP_WORDS; w++)
+				if ((d->ports[w] & ~c->ports[w]) != 0)
+					break;
+			if (w == PORT_BITMAP_WORDS)
+				break;
+		}
+		if (j == b->ncriteria)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Returns an earlier block that sets option m, or PermitOpen if m is
+ * NULL, and that matches whenever b does, so that b's value is never used.
+ */
+static struct match_block *
+match_block_shadowed(struct match_block *b, const struct match_option *m)
+{
+	struct match_block *a;
+
+	TAILQ_FOREACH(a, &match_blocks, next) {
+		if (a == b)
+			break;
+		if ((m == NULL ? a->nreplay > 0 :
+		    match_option_isset(&a->opts, m)) && match_block_covers(a, b))
+			return a;
+	}
+	return NULL;
+}
+
+/*
+ * Drop the Match blocks that can never change the options of a
+ * connection: those whose criteria contradict one another, those that
+ * set nothing, and those whose every option is set by an earlier block
+ * that matches whenever they do. They are reported, so that they can be
+ * removed from the configuration too.
+ */
+static void
+match_blocks_prune(void)
+{
+	struct match_block *b, *next, *a;
+	const struct match_option *m;
+	const char *why;
+	u_int nset, nlive, ndropped = 0;
+
+	for (b = TAILQ_FIRST(&match_blocks); b != NULL; b = next) {
+		next = TAILQ_NEXT(b, next);
+		nset = nlive = 0;
+		if (!match_criteria_satisfiable(b))
+			why = "its criteria can never all hold";
+		else {
+			for (m = match_options; m->name != NULL; m++) {
+				if (!match_option_isset(&b->opts, m))
+					continue;
+				nset++;
+				if (m->kind == MOPT_APPEND ||
+				    (a = match_block_shadowed(b, m)) == NULL) {
+					nlive++;
+					continue;
+				}
+				debug("%s line %d: %s is overridden by the "
+				    "Match at %s line %d", b->filename,
+				    b->linenum, m->name, a->filename,
+				    a->linenum);
 			}
-		} else if (strcasecmp(attrib, "host") == 0) {
-			if (ci == NULL || ci->host == NULL) {
-				result = 0;
-				continue;
+			if (b->nreplay > 0) {
+				nset++;
+				if ((a = match_block_shadowed(b, NULL)) == NULL)
+					nlive++;
+				else
+					debug("%s line %d: PermitOpen is "
+					    "overridden by the Match at %s "
+					    "line %d", b->filename, b->linenum,
+					    a->filename, a->linenum);
 			}
-			if (match_hostname(ci->host, arg, len) != 1)
-				result = 0;
+			if (nset == 0)
+				why = "it sets nothing";
+			else if (nlive == 0)
+				why = "all it sets is overridden by earlier "
+				    "Match blocks";
 			else
-				debug("connection from %.100s matched 'Host "
-				    "%.100s' at line %d", ci->host, arg, line);
-		} else if (strcasecmp(attrib, "address") == 0) {
-			if (ci == NULL || ci->address == NULL) {
-				result = 0;
 				continue;
-			}
-			switch (addr_match_list(ci->address, arg)) {
-			case 1:
-				debug("connection from %.100s matched 'Address "
-				    "%.100s' at line %d", ci->address, arg, line);
-				break;
-			case 0:
-			case -1:
-				result = 0;
-				break;
-			case -2:
-				return -1;
-			}
-		} else if (strcasecmp(attrib, "localaddress") == 0){
-			if (ci == NULL || ci->laddress == NULL) {
-				result = 0;
+		}
+		logit("%s line %d: Match block can have no effect: %s",
+		    b->filename, b->linenum, why);
+		TAILQ_REMOVE(&match_blocks, b, next);
+		match_block_free(b);
+		ndropped++;
+	}
+	if (ndropped != 0)
+		debug2("%s: %u Match blocks dropped", __func__, ndropped);
+}
+
+/*
+ * Lay out the counters of each Match block in the statistics file text,
+ * by the line of its Match directive. Blocks in the main configuration
+ * are given by line alone, as a re-executed child knows the file by
+ * another name.
+ */
+static void
+match_stats_layout(Buffer *text, const char *filename)
+{
+	struct match_block *b;
+	char *line;
+
+	if (nmatch_blocks == 0)
+		return;
+	match_stats = xcalloc(nmatch_blocks, sizeof(*match_stats));
+	buffer_append(text, "match", 5);
+	match_stat_lookups = stats_field(text, "lookups");
+	match_stat_cached = stats_field(text, "cached");
+	buffer_append(text, "\n", 1);
+	TAILQ_FOREACH(b, &match_blocks, next) {
+		if (strcmp(b->filename, filename) == 0)
+			xasprintf(&line, "match line %d", b->linenum);
+		else
+			xasprintf(&line, "match %s line %d", b->filename,
+			    b->linenum);
+		buffer_append(text, line, strlen(line));
+		free(line);
+		match_stats[b->index].evals = stats_field(text, "evals");
+		match_stats[b->index].matches = stats_field(text, "matches");
+		match_stats[b->index].nsec = stats_field(text, "nsec");
+		match_stats[b->index].group_nsec =
+		    stats_field(text, "group_nsec");
+		buffer_append(text, "\n", 1);
+	}
+}
+
+/*
+ * Identify the Match criteria, in order, for the result cache: the blocks
+ * a connection matches depend on nothing else in the configuration. File
+ * names are left out, as a re-executed child knows the main file by
+ * another name.
+ */
+static u_int64_t
+match_blocks_tag(void)
+{
+	struct match_block *b;
+	struct match_criterion *c;
+	u_int32_t h = FNV1A_INIT;
+	u_int i;
+
+	TAILQ_FOREACH(b, &match_blocks, next) {
+		h = fnv1a(h, &b->ncriteria, sizeof(b->ncriteria));
+		for (i = 0; i < b->ncriteria; i++) {
+			c = &b->criteria[i];
+			h = fnv1a(h, &c->type, sizeof(c->type));
+			if (c->arg != NULL)
+				h = fnv1a(h, c->arg, strlen(c->arg) + 1);
+		}
+	}
+	return ((u_int64_t)nmatch_blocks << 32) | h;
+}
+
+/*
+ * Called once the whole config has been parsed: index the compiled
+ * blocks, note the options each sets, build the address tries and set
+ * up the result cache.
+ */
+static void
+match_blocks_finalize(ServerOptions *options)
+{
+	struct match_block *b;
+	struct match_criterion *c;
+	struct addr_trie *t;
+	u_int i, nfallback = 0;
+
+	match_blocks_prune();
+	TAILQ_FOREACH(b, &match_blocks, next) {
+		b->index = nmatch_blocks++;
+		/* Note the options the block sets, to apply only those */
+		for (i = 0; i < MATCH_NOPTIONS; i++) {
+			if (!match_option_isset(&b->opts, &match_options[i]))
 				continue;
-			}
-			switch (addr_match_list(ci->laddress, arg)) {
-			case 1:
-				debug("connection from %.100s matched "
-				    "'LocalAddress %.100s' at line %d",
-				    ci->laddress, arg, line);
-				break;
-			case 0:
-			case -1:
-				result = 0;
-				break;
-			case -2:
-				return -1;
-			}
-		} else if (strcasecmp(attrib, "localport") == 0) {
-			if ((port = a2port(arg)) == -1) {
-				error("Invalid LocalPort '%s' on Match line",
-				    arg);
-				return -1;
-			}
-			if (ci == NULL || ci->lport == 0) {
-				result = 0;
+			b->deltas = xrealloc(b->deltas, b->ndeltas + 1,
+			    sizeof(*b->deltas));
+			b->deltas[b->ndeltas++] = i;
+		}
+		for (i = 0; i < b->ncriteria; i++) {
+			c = &b->criteria[i];
+			match_referenced |= match_criterion_refs(c->type);
+			if (c->type == MATCH_CRIT_ADDRESS)
+				t = &match_addr_trie;
+			else if (c->type == MATCH_CRIT_LOCALADDRESS)
+				t = &match_laddr_trie;
+			else
 				continue;
-			}
-			/* TODO support port lists */
-			if (port == ci->lport)
-				debug("connection from %.100s matched "
-				    "'LocalPort %d' at line %d",
-				    ci->laddress, port, line);
+			/* A list that fails still uses up its slot */
+			if (addr_trie_add_list(t, c->arg, naddr_criteria) == 0)
+				c->addr_id = naddr_criteria;
 			else
-				result = 0;
-		} else {
-			error("Unsupported Match attribute %s", attrib);
-			return -1;
+				nfallback++;
+			naddr_criteria++;
 		}
 	}
-	if (attributes == 0) {
-		error("One or more attributes required for Match");
+	if (naddr_criteria != 0)
+		debug2("%s: %u address lists indexed, %u by pattern", __func__,
+		    naddr_criteria - nfallback, nfallback);
+	if (nmatch_blocks == 0)
+		return;
+	match_block_index = xcalloc(nmatch_blocks, sizeof(*match_block_index));
+	TAILQ_FOREACH(b, &match_blocks, next)
+		match_block_index[b->index] = b;
+	debug2("%s: %u Match blocks, attributes 0x%x", __func__,
+	    nmatch_blocks, match_referenced);
+
+	if (options->match_cache_size > 0 && match_referenced != 0)
+		match_cache = shcache_open(_PATH_SSHD_MATCH_CACHE,
+		    options->match_cache_size, MATCH_CACHE_KEYLEN,
+		    MATCH_CACHE_MAXMATCH * sizeof(u_int32_t),
+		    match_blocks_tag(), "Match result cache");
+}
+
+static int
+match_cache_key_add(char *key, size_t keylen, size_t *lenp, const char *s)
+{
+	size_t l = s == NULL ? 0 : strlen(s) + 1;
+
+	if (*lenp + 1 + l > keylen)
 		return -1;
+	key[(*lenp)++] = s != NULL;
+	if (s != NULL) {
+		memcpy(key + *lenp, s, l);
+		*lenp += l;
 	}
-	if (ci != NULL)
-		debug3("match %sfound", result ? "" : "not ");
-	*condition = cp;
-	return result;
+	return 0;
+}
+
+/*
+ * Build the cache key for a connection from just those fields that the
+ * Match criteria refer to. Returns 0 on success or -1 if it is too long.
+ */
+static int
+match_cache_key(struct connection_info *ci, char *key, size_t keylen,
+    size_t *lenp)
+{
+	char port[16];
+
+	*lenp = 0;
+	snprintf(port, sizeof(port), "%d", ci->lport);
+	if (((match_referenced & MATCH_REF_USER) &&
+	    match_cache_key_add(key, keylen, lenp, ci->user) != 0) ||
+	    ((match_referenced & MATCH_REF_HOST) &&
+	    match_cache_key_add(key, keylen, lenp, ci->host) != 0) ||
+	    ((match_referenced & MATCH_REF_ADDRESS) &&
+	    match_cache_key_add(key, keylen, lenp, ci->address) != 0) ||
+	    ((match_referenced & MATCH_REF_LADDRESS) &&
+	    match_cache_key_add(key, keylen, lenp, ci->laddress) != 0) ||
+	    ((match_referenced & MATCH_REF_LPORT) &&
+	    match_cache_key_add(key, keylen, lenp, port) != 0)) {
+		*lenp = 0;
+		return -1;
+	}
+	return 0;
 }
 
 #define WHITESPACE " \t\r\n"
@@ -830,15 +2574,32 @@ static const struct multistate multistate_tcpfwd[] = {
 	{ "local",			FORWARD_LOCAL },
 	{ NULL, -1 }
 };
+static const struct multistate multistate_authtimedetect[] = {
+	{ "fixed",			AUTH_TIME_DETECT_FIXED },
+	{ "adaptive",			AUTH_TIME_DETECT_ADAPTIVE },
+	{ "rtt",			AUTH_TIME_DETECT_RTT },
+	{ NULL, -1 }
+};
+static const struct multistate multistate_authattack[] = {
+	{ "none",			AUTH_ATTACK_NONE },
+	{ "delay",			AUTH_ATTACK_DELAY },
+	{ "reject",			AUTH_ATTACK_REJECT },
+	{ NULL, -1 }
+};
 
-int
-process_server_config_line(ServerOptions *options, char *line,
+/*
+ * If blockp is not NULL, the config is being compiled at startup and
+ * directives found inside a Match block are recorded against *blockp.
+ */
+static int
+process_server_config_line_block(ServerOptions *options, char *line,
     const char *filename, int linenum, int *activep,
-    struct connection_info *connectinfo)
+    struct connection_info *connectinfo, struct match_block **blockp)
 {
-	char *cp, **charptr, *arg, *p;
-	int cmdline = 0, *intptr, value, value2, n, port;
+	char *cp, **charptr, *arg, *p, *name, *saved = NULL;
+	int cmdline = 0, *intptr, value, value2, n, port, active;
     double threshold;
+	double *dblptr, dvalue;
 	SyslogFacility *log_facility_ptr;
 	LogLevel *log_level_ptr;
 	ServerOpCodes opcode;
@@ -847,14 +2608,16 @@ process_server_config_line(ServerOptions *options, char *line,
 	long long val64;
 	const struct multistate *multistate_ptr;
 
+	if (blockp != NULL && *blockp != NULL)
+		saved = cfg_strdup(line);
 	cp = line;
 	if ((arg = strdelim(&cp)) == NULL)
-		return 0;
+		goto out;
 	/* Ignore leading whitespace */
 	if (*arg == '\0')
 		arg = strdelim(&cp);
 	if (!arg || !*arg || *arg == '#')
-		return 0;
+		goto out;
 	intptr = NULL;
 	charptr = NULL;
 	opcode = parse_token(arg, filename, linenum, &flags);
@@ -876,6 +2639,30 @@ process_server_config_line(ServerOptions *options, char *line,
 		}
 	}
 
+	if (saved != NULL && opcode != sMatch && opcode != sInclude &&
+	    (flags & SSHCFG_MATCH)) {
+		if (opcode == sPermitOpen) {
+			/* Acts on channel state; re-run it on match */
+			match_block_add_replay(*blockp, saved, linenum);
+			saved = NULL;
+		} else {
+			/* Parse the value once, into the block's options */
+			active = 1;
+			if (process_server_config_line_block(&(*blockp)->opts,
+			    saved, filename, linenum, &active, NULL,
+			    NULL) != 0)
+				fatal("%s line %d: bad directive in Match "
+				    "block", filename, linenum);
+			cfg_free(saved);
+			saved = NULL;
+			/* Already checked; nothing more to do unless active */
+			if (*activep == 0)
+				return 0;
+		}
+	}
+	cfg_free(saved);
+	saved = NULL;
+
 	switch (opcode) {
 	/* Portable-specific options */
 	case sUsePAM:
@@ -889,20 +2676,17 @@ process_server_config_line(ServerOptions *options, char *line,
 		/* ignore ports from configfile if cmdline specifies ports */
 		if (options->ports_from_cmdline)
 			return 0;
-		if (options->listen_addrs != NULL)
+		if (options->num_queued_listens > 0)
 			fatal("%s line %d: ports must be specified before "
 			    "ListenAddress.", filename, linenum);
-		if (options->num_ports >= MAX_PORTS)
-			fatal("%s line %d: too many ports.",
-			    filename, linenum);
 		arg = strdelim(&cp);
 		if (!arg || *arg == '\0')
 			fatal("%s line %d: missing port number.",
 			    filename, linenum);
-		options->ports[options->num_ports++] = a2port(arg);
-		if (options->ports[options->num_ports-1] <= 0)
+		if ((port = a2port(arg)) <= 0)
 			fatal("%s line %d: Badly formatted port number.",
 			    filename, linenum);
+		add_port(options, port);
 		break;
 
 	case sServerKeyBits:
@@ -968,7 +2752,7 @@ process_server_config_line(ServerOptions *options, char *line,
 	case sAddressFamily:
 		intptr = &options->address_family;
 		multistate_ptr = multistate_addressfamily;
-		if (options->listen_addrs != NULL)
+		if (options->num_queued_listens > 0)
 			fatal("%s line %d: address family must be specified "
 			    "before ListenAddress.", filename, linenum);
  parse_multistate:
@@ -991,22 +2775,38 @@ process_server_config_line(ServerOptions *options, char *line,
 		break;
 
 	case sHostKeyFile:
-		intptr = &options->num_host_key_files;
-		if (*intptr >= MAX_HOSTKEYS)
-			fatal("%s line %d: too many host keys specified (max %d).",
-			    filename, linenum, MAX_HOSTKEYS);
-		charptr = &options->host_key_files[*intptr];
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing file name.",
+			    filename, linenum);
+		if (*activep)
+			add_host_key(options, arg);
+		break;
+
+	case sHostCertificate:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing file name.",
+			    filename, linenum);
+		if (*activep)
+			array_append(&options->host_cert_files,
+			    &options->num_host_cert_files,
+			    cfg_strown(derelativise_path(arg)));
+		break;
+
+	case sPidFile:
+		charptr = &options->pid_file;
+		goto parse_filename;
+
+	case sStatisticsFile:
+		charptr = &options->statistics_file;
  parse_filename:
 		arg = strdelim(&cp);
 		if (!arg || *arg == '\0')
 			fatal("%s line %d: missing file name.",
 			    filename, linenum);
-		if (*activep && *charptr == NULL) {
-			*charptr = derelativise_path(arg);
-			/* increase optional counter */
-			if (intptr != NULL)
-				*intptr = *intptr + 1;
-		}
+		if (*activep && *charptr == NULL)
+			*charptr = cfg_strown(derelativise_path(arg));
 		break;
 
 	case sHostKeyAgent:
@@ -1017,23 +2817,10 @@ process_server_config_line(ServerOptions *options, char *line,
 			    filename, linenum);
 		if (*activep && *charptr == NULL)
 			*charptr = !strcmp(arg, SSH_AUTHSOCKET_ENV_NAME) ?
-			    xstrdup(arg) : derelativise_path(arg);
-		break;
-
-	case sHostCertificate:
-		intptr = &options->num_host_cert_files;
-		if (*intptr >= MAX_HOSTKEYS)
-			fatal("%s line %d: too many host certificates "
-			    "specified (max %d).", filename, linenum,
-			    MAX_HOSTCERTS);
-		charptr = &options->host_cert_files[*intptr];
-		goto parse_filename;
+			    cfg_strref(arg) :
+			    cfg_strown(derelativise_path(arg));
 		break;
 
-	case sPidFile:
-		charptr = &options->pid_file;
-		goto parse_filename;
-
 	case sPermitRootLogin:
 		intptr = &options->permit_root_login;
 		multistate_ptr = multistate_permitrootlogin;
@@ -1249,49 +3036,37 @@ process_server_config_line(ServerOptions *options, char *line,
 
 	case sAllowUsers:
 		while ((arg = strdelim(&cp)) && *arg != '\0') {
-			if (options->num_allow_users >= MAX_ALLOW_USERS)
-				fatal("%s line %d: too many allow users.",
-				    filename, linenum);
 			if (!*activep)
 				continue;
-			options->allow_users[options->num_allow_users++] =
-			    xstrdup(arg);
+			array_append(&options->allow_users,
+			    &options->num_allow_users, cfg_strref(arg));
 		}
 		break;
 
 	case sDenyUsers:
 		while ((arg = strdelim(&cp)) && *arg != '\0') {
-			if (options->num_deny_users >= MAX_DENY_USERS)
-				fatal("%s line %d: too many deny users.",
-				    filename, linenum);
 			if (!*activep)
 				continue;
-			options->deny_users[options->num_deny_users++] =
-			    xstrdup(arg);
+			array_append(&options->deny_users,
+			    &options->num_deny_users, cfg_strref(arg));
 		}
 		break;
 
 	case sAllowGroups:
 		while ((arg = strdelim(&cp)) && *arg != '\0') {
-			if (options->num_allow_groups >= MAX_ALLOW_GROUPS)
-				fatal("%s line %d: too many allow groups.",
-				    filename, linenum);
 			if (!*activep)
 				continue;
-			options->allow_groups[options->num_allow_groups++] =
-			    xstrdup(arg);
+			array_append(&options->allow_groups,
+			    &options->num_allow_groups, cfg_strref(arg));
 		}
 		break;
 
 	case sDenyGroups:
 		while ((arg = strdelim(&cp)) && *arg != '\0') {
-			if (options->num_deny_groups >= MAX_DENY_GROUPS)
-				fatal("%s line %d: too many deny groups.",
-				    filename, linenum);
 			if (!*activep)
 				continue;
-			options->deny_groups[options->num_deny_groups++] =
-			    xstrdup(arg);
+			array_append(&options->deny_groups,
+			    &options->num_deny_groups, cfg_strref(arg));
 		}
 		break;
 
@@ -1303,7 +3078,7 @@ process_server_config_line(ServerOptions *options, char *line,
 			fatal("%s line %d: Bad SSH2 cipher spec '%s'.",
 			    filename, linenum, arg ? arg : "<NONE>");
 		if (options->ciphers == NULL)
-			options->ciphers = xstrdup(arg);
+			options->ciphers = cfg_strref(arg);
 		break;
 
 	case sMacs:
@@ -1314,7 +3089,7 @@ process_server_config_line(ServerOptions *options, char *line,
 			fatal("%s line %d: Bad SSH2 mac spec '%s'.",
 			    filename, linenum, arg ? arg : "<NONE>");
 		if (options->macs == NULL)
-			options->macs = xstrdup(arg);
+			options->macs = cfg_strref(arg);
 		break;
 
 	case sKexAlgorithms:
@@ -1326,7 +3101,7 @@ process_server_config_line(ServerOptions *options, char *line,
 			fatal("%s line %d: Bad SSH2 KexAlgorithms '%s'.",
 			    filename, linenum, arg ? arg : "<NONE>");
 		if (options->kex_algorithms == NULL)
-			options->kex_algorithms = xstrdup(arg);
+			options->kex_algorithms = cfg_strref(arg);
 		break;
 
 	case sProtocol:
@@ -1343,10 +3118,6 @@ process_server_config_line(ServerOptions *options, char *line,
 		break;
 
 	case sSubsystem:
-		if (options->num_subsystems >= MAX_SUBSYSTEMS) {
-			fatal("%s line %d: too many subsystems defined.",
-			    filename, linenum);
-		}
 		arg = strdelim(&cp);
 		if (!arg || *arg == '\0')
 			fatal("%s line %d: Missing subsystem name.",
@@ -1359,12 +3130,20 @@ process_server_config_line(ServerOptions *options, char *line,
 			if (strcmp(arg, options->subsystem_name[i]) == 0)
 				fatal("%s line %d: Subsystem '%s' already defined.",
 				    filename, linenum, arg);
-		options->subsystem_name[options->num_subsystems] = xstrdup(arg);
+		name = arg;
 		arg = strdelim(&cp);
 		if (!arg || *arg == '\0')
 			fatal("%s line %d: Missing subsystem command.",
 			    filename, linenum);
-		options->subsystem_command[options->num_subsystems] = xstrdup(arg);
+		i = options->num_subsystems;
+		options->subsystem_name = xrealloc(options->subsystem_name,
+		    i + 1, sizeof(*options->subsystem_name));
+		options->subsystem_command = xrealloc(options->subsystem_command,
+		    i + 1, sizeof(*options->subsystem_command));
+		options->subsystem_args = xrealloc(options->subsystem_args,
+		    i + 1, sizeof(*options->subsystem_args));
+		options->subsystem_name[i] = cfg_strref(name);
+		options->subsystem_command[i] = cfg_strref(arg);
 
 		/* Collect arguments (separate to executable) */
 		p = xstrdup(arg);
@@ -1375,7 +3154,8 @@ process_server_config_line(ServerOptions *options, char *line,
 			strlcat(p, " ", len);
 			strlcat(p, arg, len);
 		}
-		options->subsystem_args[options->num_subsystems] = p;
+		options->subsystem_args[options->num_subsystems] =
+		    cfg_strown(p);
 		options->num_subsystems++;
 		break;
 
@@ -1409,6 +3189,107 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->max_sessions;
 		goto parse_int;
 
+	case sMatchCacheSize:
+		intptr = &options->match_cache_size;
+		goto parse_int;
+
+	case sAuthTimeDetection:
+		intptr = &options->auth_time_detection;
+		multistate_ptr = multistate_authtimedetect;
+		goto parse_multistate;
+
+	case sAuthTimeSources:
+		intptr = &options->auth_time_sources;
+		goto parse_int;
+
+	case sAuthTimeSourceFile:
+		charptr = &options->auth_time_source_file;
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing file name.",
+			    filename, linenum);
+		if (*activep && *charptr == NULL)
+			*charptr = strcasecmp(arg, "none") == 0 ?
+			    cfg_strref(arg) :
+			    cfg_strown(derelativise_path(arg));
+		break;
+
+	case sAuthTimeAttackPolicy:
+		intptr = &options->auth_time_attack_policy;
+		multistate_ptr = multistate_authattack;
+		goto parse_multistate;
+
+	case sAuthTimeAttackDelay:
+		dblptr = &options->auth_time_attack_delay;
+		goto parse_double;
+
+	case sAuthTimeAttackMaxTries:
+		intptr = &options->auth_time_attack_max_tries;
+		goto parse_int;
+
+	case sAuthTimeAttackDisconnect:
+		intptr = &options->auth_time_attack_disconnect;
+		goto parse_int;
+
+	case sAuthTimeTarpit:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing value.", filename, linenum);
+		dvalue = strtod(arg, &p);
+		if (*p != '\0' || !isfinite(dvalue) || dvalue < 0)
+			fatal("%s line %d: invalid value '%s'.",
+			    filename, linenum, arg);
+		if (*activep && options->auth_time_tarpit < 0)
+			options->auth_time_tarpit = dvalue;
+		if (cp != NULL && *cp != '\0') { /* optional maximum */
+			dblptr = &options->auth_time_tarpit_max;
+			goto parse_double;
+		}
+		break;
+
+	case sAuthTimeRTTFactor:
+		dblptr = &options->auth_time_rtt_factor;
+		goto parse_double;
+
+	case sAuthTimeRTTFloor:
+		dblptr = &options->auth_time_rtt_floor;
+ parse_double:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing value.", filename, linenum);
+		dvalue = strtod(arg, &p);
+		if (*p != '\0' || !isfinite(dvalue) || dvalue < 0)
+			fatal("%s line %d: invalid value '%s'.",
+			    filename, linenum, arg);
+		if (*activep && *dblptr < 0)
+			*dblptr = dvalue;
+		break;
+
+	case sInclude:
+		/* Expanded by load_server_config(); see parse_server_config() */
+		if (cmdline)
+			fatal("Include directive not supported as a "
+			    "command-line option");
+		value = 0;
+		while ((arg = strdelim(&cp)) != NULL && *arg != '\0')
+			value++;
+		if (value == 0)
+			fatal("%s line %d: Include missing filename argument",
+			    filename, linenum);
+		break;
+
+	case sGroupCacheTime:
+		intptr = &options->group_cache_time;
+		goto parse_time;
+
+	case sHostnameCacheTime:
+		intptr = &options->hostname_cache_time;
+		goto parse_time;
+
+	case sHostnameLookupTimeout:
+		intptr = &options->hostname_lookup_timeout;
+		goto parse_time;
+
 	case sBanner:
 		charptr = &options->banner;
 		goto parse_filename;
@@ -1422,14 +3303,10 @@ process_server_config_line(ServerOptions *options, char *line,
 	case sAuthorizedKeysFile:
 		if (*activep && options->num_authkeys_files == 0) {
 			while ((arg = strdelim(&cp)) && *arg != '\0') {
-				if (options->num_authkeys_files >=
-				    MAX_AUTHKEYS_FILES)
-					fatal("%s line %d: "
-					    "too many authorized keys files.",
-					    filename, linenum);
-				options->authorized_keys_files[
-				    options->num_authkeys_files++] =
-				    tilde_expand_filename(arg, getuid());
+				array_append(&options->authorized_keys_files,
+				    &options->num_authkeys_files,
+				    cfg_strown(tilde_expand_filename(arg,
+				    getuid())));
 			}
 		}
 		return 0;
@@ -1441,7 +3318,8 @@ process_server_config_line(ServerOptions *options, char *line,
 			fatal("%s line %d: missing file name.",
 			    filename, linenum);
 		if (*activep && *charptr == NULL) {
-			*charptr = tilde_expand_filename(arg, getuid());
+			*charptr = cfg_strown(tilde_expand_filename(arg,
+			    getuid()));
 			/* increase optional counter */
 			if (intptr != NULL)
 				*intptr = *intptr + 1;
@@ -1461,13 +3339,10 @@ process_server_config_line(ServerOptions *options, char *line,
 			if (strchr(arg, '=') != NULL)
 				fatal("%s line %d: Invalid environment name.",
 				    filename, linenum);
-			if (options->num_accept_env >= MAX_ACCEPT_ENV)
-				fatal("%s line %d: too many allow env.",
-				    filename, linenum);
 			if (!*activep)
 				continue;
-			options->accept_env[options->num_accept_env++] =
-			    xstrdup(arg);
+			array_append(&options->accept_env,
+			    &options->num_accept_env, cfg_strref(arg));
 		}
 		break;
 
@@ -1494,7 +3369,10 @@ process_server_config_line(ServerOptions *options, char *line,
 		if (cmdline)
 			fatal("Match directive not supported as a command-line "
 			   "option");
-		value = match_cfg_line(&cp, linenum, connectinfo);
+		if (blockp != NULL)
+			value = match_block_new(&cp, filename, linenum, blockp);
+		else
+			value = match_cfg_line(&cp, linenum, connectinfo);
 		if (value < 0)
 			fatal("%s line %d: Bad Match condition", filename,
 			    linenum);
@@ -1544,7 +3422,7 @@ process_server_config_line(ServerOptions *options, char *line,
 			    linenum);
 		len = strspn(cp, WHITESPACE);
 		if (*activep && options->adm_forced_command == NULL)
-			options->adm_forced_command = xstrdup(cp + len);
+			options->adm_forced_command = cfg_strref(cp + len);
 		return 0;
 
 	case sChrootDirectory:
@@ -1555,7 +3433,7 @@ process_server_config_line(ServerOptions *options, char *line,
 			fatal("%s line %d: missing file name.",
 			    filename, linenum);
 		if (*activep && *charptr == NULL)
-			*charptr = xstrdup(arg);
+			*charptr = cfg_strref(arg);
 		break;
 
 	case sTrustedUserCAKeys:
@@ -1590,12 +3468,12 @@ process_server_config_line(ServerOptions *options, char *line,
 		len = strspn(cp, WHITESPACE);
 		if (*activep && options->version_addendum == NULL) {
 			if (strcasecmp(cp + len, "none") == 0)
-				options->version_addendum = xstrdup("");
+				options->version_addendum = cfg_strdup("");
 			else if (strchr(cp + len, '\r') != NULL)
 				fatal("%.200s line %d: Invalid argument",
 				    filename, linenum);
 			else
-				options->version_addendum = xstrdup(cp + len);
+				options->version_addendum = cfg_strref(cp + len);
 		}
 		return 0;
 
@@ -1606,7 +3484,7 @@ process_server_config_line(ServerOptions *options, char *line,
 				fatal("%.200s line %d: AuthorizedKeysCommand "
 				    "must be an absolute path",
 				    filename, linenum);
-			options->authorized_keys_command = xstrdup(cp + len);
+			options->authorized_keys_command = cfg_strref(cp + len);
 		}
 		return 0;
 
@@ -1615,23 +3493,18 @@ process_server_config_line(ServerOptions *options, char *line,
 
 		arg = strdelim(&cp);
 		if (*activep && *charptr == NULL)
-			*charptr = xstrdup(arg);
+			*charptr = cfg_strref(arg);
 		break;
 
 	case sAuthenticationMethods:
 		if (*activep && options->num_auth_methods == 0) {
 			while ((arg = strdelim(&cp)) && *arg != '\0') {
-				if (options->num_auth_methods >=
-				    MAX_AUTH_METHODS)
-					fatal("%s line %d: "
-					    "too many authentication methods.",
-					    filename, linenum);
 				if (auth2_methods_valid(arg, 0) != 0)
 					fatal("%s line %d: invalid "
 					    "authentication method list.",
 					    filename, linenum);
-				options->auth_methods[
-				    options->num_auth_methods++] = xstrdup(arg);
+				array_append(&options->auth_methods,
+				    &options->num_auth_methods, cfg_strref(arg));
 			}
 		}
 		return 0;
@@ -1654,60 +3527,529 @@ process_server_config_line(ServerOptions *options, char *line,
 		fatal("%s line %d: Missing handler for opcode %s (%d)",
 		    filename, linenum, arg, opcode);
 	}
-	if ((arg = strdelim(&cp)) != NULL && *arg != '\0')
-		fatal("%s line %d: garbage at end of line; \"%.200s\".",
-		    filename, linenum, arg);
-	return 0;
+	if ((arg = strdelim(&cp)) != NULL && *arg != '\0')
+		fatal("%s line %d: garbage at end of line; \"%.200s\".",
+		    filename, linenum, arg);
+	return 0;
+ out:
+	cfg_free(saved);
+	return 0;
+}
+
+int
+process_server_config_line(ServerOptions *options, char *line,
+    const char *filename, int linenum, int *activep,
+    struct connection_info *connectinfo)
+{
+	return process_server_config_line_block(options, line, filename,
+	    linenum, activep, connectinfo, NULL);
+}
+
+/* Reads the server configuration file. */
+
+/* Read the whole of a file that cannot be mapped */
+static u_char *
+load_server_config_fd(int fd, const char *filename, size_t *lenp)
+{
+	u_char *data = NULL;
+	size_t len = 0, alloc = 0;
+	ssize_t r;
+
+	for (;;) {
+		if (len == alloc) {
+			alloc = alloc == 0 ? 8192 : alloc * 2;
+			data = xrealloc(data, 1, alloc);
+		}
+		if ((r = read(fd, data + len, alloc - len)) == 0)
+			break;
+		if (r == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fatal("%s: read %s: %s", __func__, filename,
+			    strerror(errno));
+		}
+		len += r;
+	}
+	*lenp = len;
+	return data;
+}
+
+/* Append len bytes to conf, in pieces the Buffer code will accept */
+static void
+load_server_config_append(Buffer *conf, const u_char *data, size_t len)
+{
+	size_t n;
+
+	for (; len > 0; data += n, len -= n) {
+		n = MIN(len, BUFFER_MAX_CHUNK);
+		buffer_append(conf, data, n);
+	}
+}
+
+/*
+ * Load a config file into conf, trimming out comments and leading
+ * whitespace. Newlines are kept as they are needed to reproduce line
+ * numbers later for error messages. The file is mapped where possible
+ * and split with memchr(), so there is no limit on line length. Runs of
+ * lines that need no trimming are appended as one.
+ */
+static void
+load_server_config_text(const char *filename, Buffer *conf)
+{
+	struct stat st;
+	u_char *map = NULL, *data, *cp, *end, *eol, *p, *q, *run, *rend;
+	size_t len = 0;
+	int fd;
+
+	debug2("%s: filename %s", __func__, filename);
+	if ((fd = open(filename, O_RDONLY)) == -1) {
+		perror(filename);
+		exit(1);
+	}
+	if (fstat(fd, &st) == -1)
+		fatal("%s: fstat %s: %s", __func__, filename, strerror(errno));
+#if defined(HAVE_MMAP) && defined(MAP_PRIVATE)
+	if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (u_int64_t)st.st_size < UINT_MAX) {
+		if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		    fd, (off_t)0)) == MAP_FAILED)
+			map = NULL;
+		else
+			len = st.st_size;
+	}
+#endif
+	data = map != NULL ? map : load_server_config_fd(fd, filename, &len);
+	close(fd);
+	if (len >= UINT_MAX)
+		fatal("%s: %s too large", __func__, filename);
+
+	buffer_clear(conf);
+	for (run = rend = cp = data, end = data + len; cp < end; cp = eol) {
+		if ((eol = memchr(cp, '\n', end - cp)) == NULL)
+			eol = end;
+		else
+			eol++;
+		while (cp < eol && (*cp == ' ' || *cp == '\t' || *cp == '\r'))
+			cp++;
+		/* Cut comments, and any NUL that would end the config early */
+		p = memchr(cp, '#', eol - cp);
+		if ((q = memchr(cp, '\0', (p ? p : eol) - cp)) != NULL)
+			p = q;
+		if (cp != rend) {
+			load_server_config_append(conf, run, rend - run);
+			run = cp;
+		}
+		if (p == NULL) {
+			rend = eol;
+			continue;
+		}
+		load_server_config_append(conf, run, p - run);
+		buffer_put_char(conf, '\n');
+		run = rend = eol;
+	}
+	load_server_config_append(conf, run, rend - run);
+	buffer_put_char(conf, '\0');
+
+#if defined(HAVE_MMAP) && defined(MAP_PRIVATE)
+	if (map != NULL)
+		munmap(map, len);
+	else
+#endif
+		free(data);
+}
+
+/*
+ * Include is expanded as the config is loaded, so that the text is
+ * complete in itself: a re-executed sshd is sent it like any other config
+ * and parses it without reading the included files again. Each Include
+ * line is followed by the files it matches, each between an INCLUDE_MARK
+ * "include <path>" line and an INCLUDE_MARK "end" line, which
+ * parse_server_config() takes to switch the file name and line numbers
+ * used in messages. No line in a file may start with INCLUDE_MARK.
+ *
+ * The files read are kept, so that a file included more than once is
+ * only read again if it has changed.
+ */
+#define INCLUDE_MARK		'\001'
+#define INCLUDE_MAX_DEPTH	16
+
+struct include_file {
+	TAILQ_ENTRY(include_file) next;
+	char	*path;
+	dev_t	 dev;
+	ino_t	 ino;
+	off_t	 size;
+	time_t	 mtime;
+	char	*text;			/* from load_server_config_text() */
+};
+TAILQ_HEAD(include_files, include_file);
+
+static struct include_files include_files =
+    TAILQ_HEAD_INITIALIZER(include_files);
+
+static void load_server_config_expand(Buffer *, const char *, int);
+
+static const char *
+include_file_text(const char *path)
+{
+	struct include_file *f;
+	struct stat st;
+	Buffer b;
+
+	if (stat(path, &st) == -1)
+		return NULL;
+	TAILQ_FOREACH(f, &include_files, next) {
+		if (strcmp(f->path, path) == 0)
+			break;
+	}
+	if (f != NULL && f->dev == st.st_dev && f->ino == st.st_ino &&
+	    f->size == st.st_size && f->mtime == st.st_mtime) {
+		debug3("%s: %s unchanged", __func__, path);
+		return f->text;
+	}
+	if (f == NULL) {
+		f = xcalloc(1, sizeof(*f));
+		f->path = xstrdup(path);
+		TAILQ_INSERT_TAIL(&include_files, f, next);
+	}
+	buffer_init(&b);
+	load_server_config_text(path, &b);
+	free(f->text);
+	f->text = xstrdup(buffer_ptr(&b));
+	buffer_free(&b);
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->size = st.st_size;
+	f->mtime = st.st_mtime;
+	return f->text;
+}
+
+/*
+ * Append to out the files matched by an Include argument, expanded in
+ * turn. Relative paths are taken from SSHDIR.
+ */
+static void
+load_server_config_include(Buffer *out, const char *arg,
+    const char *filename, int linenum, int depth)
+{
+	char *pattern, mark[2] = { INCLUDE_MARK, '\0' };
+	const char *text;
+	glob_t gbuf;
+	Buffer b;
+	size_t i;
+	int r;
+
+	if (depth >= INCLUDE_MAX_DEPTH)
+		fatal("%s line %d: too many nested Include directives",
+		    filename, linenum);
+	if (*arg == '/')
+		pattern = xstrdup(arg);
+	else
+		xasprintf(&pattern, "%s/%s", SSHDIR, arg);
+	memset(&gbuf, 0, sizeof(gbuf));
+	if ((r = glob(pattern, 0, NULL, &gbuf)) != 0) {
+		if (r != GLOB_NOMATCH)
+			fatal("%s line %d: Include \"%s\" glob failed",
+			    filename, linenum, pattern);
+		debug2("%s line %d: no match for Include \"%s\"",
+		    filename, linenum, pattern);
+		free(pattern);
+		return;
+	}
+	buffer_init(&b);
+	for (i = 0; i < gbuf.gl_pathc; i++) {
+		debug2("%s line %d: including %s", filename, linenum,
+		    gbuf.gl_pathv[i]);
+		if (strchr(gbuf.gl_pathv[i], '\n') != NULL)
+			fatal("%s line %d: bad Include file name",
+			    filename, linenum);
+		if ((text = include_file_text(gbuf.gl_pathv[i])) == NULL)
+			fatal("%s line %d: Include %s: %s", filename, linenum,
+			    gbuf.gl_pathv[i], strerror(errno));
+		buffer_clear(&b);
+		load_server_config_append(&b, text, strlen(text) + 1);
+		load_server_config_expand(&b, gbuf.gl_pathv[i], depth + 1);
+		buffer_append(out, "\n", 1);
+		buffer_append(out, mark, 1);
+		buffer_append(out, "include ", 8);
+		buffer_append(out, gbuf.gl_pathv[i],
+		    strlen(gbuf.gl_pathv[i]));
+		buffer_append(out, "\n", 1);
+		/* Without its NUL */
+		load_server_config_append(out, buffer_ptr(&b),
+		    buffer_len(&b) - 1);
+		buffer_append(out, "\n", 1);
+		buffer_append(out, mark, 1);
+		buffer_append(out, "end", 3);
+	}
+	buffer_free(&b);
+	globfree(&gbuf);
+	free(pattern);
 }
 
-/* Reads the server configuration file. */
+/*
+ * Expand the Include lines of the NUL-terminated text in conf, loaded
+ * from filename, in place.
+ */
+static void
+load_server_config_expand(Buffer *conf, const char *filename, int depth)
+{
+	Buffer out;
+	char *text, *line, *next, *copy, *cp, *arg;
+	int linenum, found = 0;
+
+	text = buffer_ptr(conf);
+	for (line = text, linenum = 1; line != NULL; line = next, linenum++) {
+		if ((next = strchr(line, '\n')) != NULL)
+			next++;
+		if (*line == INCLUDE_MARK)
+			fatal("%s line %d: invalid character", filename,
+			    linenum);
+		if (strncasecmp(line, "include", 7) == 0)
+			found = 1;
+	}
+	if (!found)
+		return;
+
+	buffer_init(&out);
+	for (line = text, linenum = 1; line != NULL; line = next, linenum++) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		if (line != text)
+			buffer_append(&out, "\n", 1);
+		load_server_config_append(&out, line, strlen(line));
+		if (strncasecmp(line, "include", 7) != 0)
+			continue;
+		/* Tokenise a copy as process_server_config_line() does */
+		cp = copy = xstrdup(line);
+		if ((arg = strdelim(&cp)) != NULL &&
+		    strcasecmp(arg, "include") == 0) {
+			while ((arg = strdelim(&cp)) != NULL && *arg != '\0')
+				load_server_config_include(&out, arg,
+				    filename, linenum, depth);
+		}
+		free(copy);
+	}
+	buffer_put_char(&out, '\0');
+	buffer_clear(conf);
+	load_server_config_append(conf, buffer_ptr(&out), buffer_len(&out));
+	buffer_free(&out);
+}
 
+/*
+ * Load a config file into conf, trimmed as by load_server_config_text()
+ * and with its Include directives expanded.
+ */
 void
 load_server_config(const char *filename, Buffer *conf)
 {
-	char line[4096], *cp;
-	FILE *f;
-	int lineno = 0;
+	load_server_config_text(filename, conf);
+	load_server_config_expand(conf, filename, 0);
+	debug2("%s: done config len = %d", __func__, buffer_len(conf));
+}
 
-	debug2("%s: filename %s", __func__, filename);
-	if ((f = fopen(filename, "r")) == NULL) {
-		perror(filename);
-		exit(1);
+/*
+ * Test the criteria of every Match block against a connection, storing
+ * the indices of those that match in matched. Returns the number matched.
+ */
+static u_int
+match_blocks_eval(struct connection_info *connectinfo, u_int32_t *matched)
+{
+	struct match_block *b;
+	struct match_stat *st;
+	u_char *addr_hits;
+	u_int64_t start = 0, group_nsec = 0;
+	int result;
+	u_int nmatched = 0;
+
+	addr_hits = match_addr_lookup(connectinfo);
+	TAILQ_FOREACH(b, &match_blocks, next) {
+		debug3("checking match at %s line %d for user %s host %s "
+		    "addr %s laddr %s lport %d", b->filename, b->linenum,
+		    connectinfo->user ? connectinfo->user : "(null)",
+		    connectinfo->host ? connectinfo->host : "(null)",
+		    connectinfo->address ? connectinfo->address : "(null)",
+		    connectinfo->laddress ? connectinfo->laddress : "(null)",
+		    connectinfo->lport);
+		st = match_stats == NULL ? NULL : &match_stats[b->index];
+		if (st != NULL)
+			start = monotime_nsec();
+		result = match_cfg_eval(b->criteria, b->ncriteria, b->linenum,
+		    connectinfo, addr_hits, st == NULL ? NULL : &group_nsec);
+		if (st != NULL) {
+			stats_add(st->nsec, monotime_nsec() - start);
+			stats_add(st->evals, 1);
+			stats_add(st->group_nsec, group_nsec);
+			group_nsec = 0;
+		}
+		if (result < 0)
+			fatal("%s line %d: Bad Match condition", b->filename,
+			    b->linenum);
+		debug3("match %sfound", result ? "" : "not ");
+		if (result != 0)
+			matched[nmatched++] = b->index;
 	}
-	buffer_clear(conf);
-	while (fgets(line, sizeof(line), f)) {
-		lineno++;
-		if (strlen(line) == sizeof(line) - 1)
-			fatal("%s line %d too long", filename, lineno);
-		/*
-		 * Trim out comments and strip whitespace
-		 * NB - preserve newlines, they are needed to reproduce
-		 * line numbers later for error messages
-		 */
-		if ((cp = strchr(line, '#')) != NULL)
-			memcpy(cp, "\n", 2);
-		cp = line + strspn(line, " \t\r");
+	free(addr_hits);
+	return nmatched;
+}
 
-		buffer_append(conf, cp, strlen(cp));
+/*
+ * Set option m in dst from the block options src. Strings are shared
+ * with the block, which keeps them as long as its arena; lists are
+ * copied, or appended to what dst already holds for MOPT_APPEND. The
+ * strings replaced are freed unless an arena owns them.
+ */
+static void
+match_option_apply(ServerOptions *dst, const ServerOptions *src,
+    const struct match_option *m)
+{
+	char *d = (char *)dst + m->off;
+	const char *s = (const char *)src + m->off;
+	char **sp, **list;
+	u_int i, n, *np;
+
+	switch (m->kind) {
+	case MOPT_INT:
+		*(int *)d = *(const int *)s;
+		break;
+	case MOPT_INT64:
+		*(int64_t *)d = *(const int64_t *)s;
+		break;
+	case MOPT_STR:
+		sp = (char **)d;
+		if (*sp != *(char * const *)s) {
+			cfg_free(*sp);
+			*sp = *(char * const *)s;
+		}
+		break;
+	case MOPT_ARRAY:
+	case MOPT_APPEND:
+		list = *(char ** const *)s;
+		n = *(const u_int *)((const char *)src + m->numoff);
+		np = (u_int *)((char *)dst + m->numoff);
+		if (m->kind == MOPT_ARRAY) {
+			cfg_free_list(*(char ***)d, *np);
+			*(char ***)d = xcalloc(n, sizeof(*list));
+			memcpy(*(char ***)d, list, n * sizeof(*list));
+			*np = n;
+		} else {
+			for (i = 0; i < n; i++)
+				array_append((char ***)d, np, list[i]);
+		}
+		break;
+	}
+}
+
+/*
+ * Apply the matching blocks to options, touching only the options they
+ * set. As when parsing, the first block to set an option wins, except
+ * for the lists that accumulate; those replace the list in options.
+ */
+static void
+match_blocks_apply(ServerOptions *options, const u_int32_t *matched,
+    u_int nmatched, struct connection_info *connectinfo)
+{
+	struct match_block *b;
+	const struct match_option *m;
+	u_char seen[MATCH_NOPTIONS];
+	ServerOptions ro;
+	char *line;
+	int active, replayed = 0;
+	u_int i, j;
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < nmatched; i++) {
+		b = match_block_index[matched[i]];
+		for (j = 0; j < b->ndeltas; j++) {
+			m = &match_options[b->deltas[j]];
+			if (seen[b->deltas[j]] && m->kind != MOPT_APPEND)
+				continue;
+			if (!seen[b->deltas[j]] && m->kind == MOPT_APPEND) {
+				cfg_free_list(*(char ***)((char *)options +
+				    m->off), *(u_int *)((char *)options +
+				    m->numoff));
+				*(char ***)((char *)options + m->off) = NULL;
+				*(u_int *)((char *)options + m->numoff) = 0;
+			}
+			seen[b->deltas[j]] = 1;
+			match_option_apply(options, &b->opts, m);
+		}
+		/* PermitOpen acts on the channel layer; replay it */
+		for (j = 0; j < b->nreplay; j++) {
+			if (!replayed) {
+				initialize_server_options(&ro);
+				replayed = 1;
+			}
+			line = xstrdup(b->replay[j].line);
+			active = 1;
+			if (process_server_config_line(&ro, line, b->filename,
+			    b->replay[j].linenum, &active, connectinfo) != 0)
+				fatal("%s line %d: bad configuration option",
+				    b->filename, b->replay[j].linenum);
+			free(line);
+		}
 	}
-	buffer_append(conf, "\0", 1);
-	fclose(f);
-	debug2("%s: done config len = %d", __func__, buffer_len(conf));
 }
 
 void
 parse_server_match_config(ServerOptions *options,
    struct connection_info *connectinfo)
 {
-	ServerOptions mo;
+	u_int32_t *matched;
+	u_int i, nmatched;
+	char key[MATCH_CACHE_KEYLEN];
+	size_t klen = 0, vlen;
 
-	initialize_server_options(&mo);
-	parse_server_config(&mo, "reprocess config", &cfg, connectinfo);
-	copy_set_server_options(options, &mo, 0);
+	if (nmatch_blocks == 0)
+		return;
+	matched = xcalloc(nmatch_blocks, sizeof(*matched));
+	if (match_stats != NULL) {
+		stats_begin();
+		stats_add(match_stat_lookups, 1);
+	}
+	if (match_cache != NULL &&
+	    match_cache_key(connectinfo, key, sizeof(key), &klen) == 0 &&
+	    shcache_get(match_cache, key, klen, matched,
+	    nmatch_blocks * sizeof(*matched), &vlen, MATCH_CACHE_TTL) == 0) {
+		nmatched = vlen / sizeof(*matched);
+		debug("%s: cached result, %u Match blocks apply", __func__,
+		    nmatched);
+		if (match_stats != NULL)
+			stats_add(match_stat_cached, 1);
+	} else {
+		nmatched = match_blocks_eval(connectinfo, matched);
+		if (match_cache != NULL && nmatched <= MATCH_CACHE_MAXMATCH)
+			shcache_put(match_cache, key, klen, matched,
+			    nmatched * sizeof(*matched));
+	}
+	for (i = 0; i < nmatched; i++) {
+		if (matched[i] >= nmatch_blocks)
+			fatal("%s: bad Match block index %u", __func__,
+			    matched[i]);
+		if (match_stats != NULL)
+			stats_add(match_stats[matched[i]].matches, 1);
+	}
+	stats_end();
+	match_blocks_apply(options, matched, nmatched, connectinfo);
+	free(matched);
 }
 
+/*
+ * The batch test mode (see dump_config_batch()), set up by the batch=,
+ * jobs= and format= keys of a test spec.
+ */
+static struct {
+	char	*path;		/* specs file, or "-" for stdin */
+	int	 jobs;		/* worker processes */
+	int	 diff;		/* format=diff */
+	int	 running;	/* evaluating the specs */
+} test_batch;
+
+static void dump_config_batch(ServerOptions *);
+
 int parse_server_match_testspec(struct connection_info *ci, char *spec)
 {
+	const char *errstr;
 	char *p;
 
 	while ((p = strsep(&spec, ",")) && *p != '\0') {
@@ -1726,12 +4068,35 @@ int parse_server_match_testspec(struct connection_info *ci, char *spec)
 				   " specification %s\n", p+6, p);
 				return -1;
 			}
+		} else if (strncmp(p, "batch=", 6) == 0 &&
+		    !test_batch.running && p[6] != '\0') {
+			free(test_batch.path);
+			test_batch.path = xstrdup(p + 6);
+		} else if (strncmp(p, "jobs=", 5) == 0 && !test_batch.running) {
+			test_batch.jobs = strtonum(p + 5, 1, 1024, &errstr);
+			if (errstr != NULL) {
+				fprintf(stderr, "Invalid jobs '%s' in test mode"
+				   " specification %s\n", p+5, p);
+				return -1;
+			}
+		} else if (strncmp(p, "format=", 7) == 0 &&
+		    !test_batch.running && (strcmp(p + 7, "diff") == 0 ||
+		    strcmp(p + 7, "full") == 0)) {
+			test_batch.diff = strcmp(p + 7, "diff") == 0;
 		} else {
 			fprintf(stderr, "Invalid test mode specification %s\n",
 			   p);
 			return -1;
 		}
 	}
+	if ((test_batch.path != NULL || test_batch.jobs != 0 ||
+	    test_batch.diff) && !test_batch.running &&
+	    (test_batch.path == NULL || ci->user != NULL ||
+	    ci->host != NULL || ci->address != NULL)) {
+		fprintf(stderr, "Test mode batch=FILE takes no user, host "
+		    "or addr; jobs= and format= need batch=FILE\n");
+		return -1;
+	}
 	return 0;
 }
 
@@ -1748,6 +4113,139 @@ int server_match_spec_complete(struct connection_info *ci)
 	return 0;	/* partial */
 }
 
+/*
+ * Compiled forms of the AllowUsers, DenyUsers, AllowGroups, DenyGroups and
+ * AcceptEnv lists, made on first use and remade when the list they came
+ * from may have changed: when its entry pointers differ, or since
+ * config_generation was bumped.
+ */
+struct pattern_array {
+	char	**src;		/* entries compiled */
+	u_int	  n;
+	struct pattern_set *ps;
+	char	**host;		/* host part of user@host entries */
+	u_int	 *ids;		/* scratch */
+	u_int	  generation;	/* config_generation when compiled */
+};
+
+static struct pattern_array allow_users_pa, deny_users_pa, accept_env_pa;
+static struct pattern_array allow_groups_pa, deny_groups_pa;
+
+static struct pattern_array *
+pattern_array_get(struct pattern_array *pa, char **list, u_int n,
+    int userhost)
+{
+	char *at;
+	u_int i;
+
+	if (n == 0)
+		return NULL;
+	if (pa->ps != NULL && pa->n == n &&
+	    pa->generation == config_generation &&
+	    memcmp(pa->src, list, n * sizeof(*list)) == 0)
+		return pa;
+
+	pattern_set_free(pa->ps);
+	if (pa->host != NULL)
+		for (i = 0; i < pa->n; i++)
+			free(pa->host[i]);
+	free(pa->host);
+	free(pa->src);
+	free(pa->ids);
+
+	pa->n = n;
+	pa->generation = config_generation;
+	pa->src = xcalloc(n, sizeof(*pa->src));
+	memcpy(pa->src, list, n * sizeof(*list));
+	pa->host = userhost ? xcalloc(n, sizeof(*pa->host)) : NULL;
+	pa->ids = xcalloc(n, sizeof(*pa->ids));
+	pa->ps = pattern_set_new(0);
+	for (i = 0; i < n; i++) {
+		if (userhost && (at = strchr(list[i], '@')) != NULL) {
+			pattern_set_add(pa->ps, list[i], at - list[i], 0);
+			pa->host[i] = xstrdup(at + 1);
+		} else
+			pattern_set_add(pa->ps, list[i], strlen(list[i]), 0);
+	}
+	pattern_set_finish(pa->ps);
+	return pa;
+}
+
+/*
+ * Returns 1 if the user, connecting from host/ipaddr, is named in the
+ * DenyUsers list (if deny is set) or AllowUsers list, testing each entry
+ * as match_user() does. For allowed_user() in auth.c, in place of its
+ * loops over those lists.
+ */
+int
+server_match_user_list(ServerOptions *o, int deny, const char *user,
+    const char *host, const char *ipaddr)
+{
+	struct pattern_array *pa;
+	u_int i, n;
+
+	if (deny)
+		pa = pattern_array_get(&deny_users_pa, o->deny_users,
+		    o->num_deny_users, 1);
+	else
+		pa = pattern_array_get(&allow_users_pa, o->allow_users,
+		    o->num_allow_users, 1);
+	if (pa == NULL)
+		return 0;
+	n = pattern_set_match_ids(pa->ps, user, pa->ids);
+	for (i = 0; i < n; i++) {
+		if (pa->host[pa->ids[i]] == NULL ||
+		    match_host_and_ip(host, ipaddr,
+		    pa->host[pa->ids[i]]) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if one of the user's groups is named in the DenyGroups list
+ * (if deny is set) or AllowGroups list, as ga_match() would find. For
+ * allowed_user() in auth.c, in place of ga_init() and ga_match(); the
+ * groups are those Match Group resolved for the connection.
+ */
+int
+server_match_group_list(ServerOptions *o, int deny, const char *user,
+    gid_t base)
+{
+	struct pattern_array *pa;
+	u_int i;
+
+	if (deny)
+		pa = pattern_array_get(&deny_groups_pa, o->deny_groups,
+		    o->num_deny_groups, 0);
+	else
+		pa = pattern_array_get(&allow_groups_pa, o->allow_groups,
+		    o->num_allow_groups, 0);
+	if (pa == NULL)
+		return 0;
+	user_groups_get(user, base);
+	for (i = 0; i < user_groups.ngroups; i++)
+		if (pattern_set_match_list(pa->ps, user_groups.names[i]) == 1)
+			return 1;
+	return 0;
+}
+
+/*
+ * Returns 1 if an environment variable may be accepted from the client.
+ * For the env request handler in session.c, in place of its loop over
+ * AcceptEnv.
+ */
+int
+server_accept_env(ServerOptions *o, const char *name)
+{
+	struct pattern_array *pa;
+
+	if ((pa = pattern_array_get(&accept_env_pa, o->accept_env,
+	    o->num_accept_env, 0)) == NULL)
+		return 0;
+	return pattern_set_match_list(pa->ps, name) == 1;
+}
+
 /*
  * Copy any supported values that are set.
  *
@@ -1789,59 +4287,188 @@ copy_set_server_options(ServerOptions *dst, ServerOptions *src, int preauth)
 	M_CP_INTOPT(rekey_limit);
 	M_CP_INTOPT(rekey_interval);
 
-	/* M_CP_STROPT and M_CP_STRARRAYOPT should not appear before here */
+	/*
+	 * M_CP_STROPT and M_CP_STRARRAYOPT_ALLOC should not appear before
+	 * here
+	 */
 #define M_CP_STROPT(n) do {\
 	if (src->n != NULL && dst->n != src->n) { \
-		free(dst->n); \
+		cfg_free(dst->n); \
 		dst->n = src->n; \
 	} \
 } while(0)
-#define M_CP_STRARRAYOPT(n, num_n) do {\
+/* The strings are shared with src; only the array is replaced */
+#define M_CP_STRARRAYOPT_ALLOC(n, num_n) do {\
 	if (src->num_n != 0) { \
+		free(dst->n); \
+		dst->n = xcalloc(src->num_n, sizeof(*dst->n)); \
 		for (dst->num_n = 0; dst->num_n < src->num_n; dst->num_n++) \
-			dst->n[dst->num_n] = xstrdup(src->n[dst->num_n]); \
+			dst->n[dst->num_n] = src->n[dst->num_n]; \
 	} \
 } while(0)
 
 	/* See comment in servconf.h */
 	COPY_MATCH_STRING_OPTS();
+	/* The lists may now hold other strings at addresses compiled */
+	config_generation++;
 
 	/*
 	 * The only things that should be below this point are string options
 	 * which are only used after authentication.
 	 */
-	if (preauth)
-		return;
-
-	M_CP_STROPT(adm_forced_command);
-	M_CP_STROPT(chroot_directory);
+	if (!preauth) {
+		M_CP_STROPT(adm_forced_command);
+		M_CP_STROPT(chroot_directory);
+	}
 }
 
 #undef M_CP_INTOPT
 #undef M_CP_STROPT
-#undef M_CP_STRARRAYOPT
+#undef M_CP_STRARRAYOPT_ALLOC
+
+/* Start counting into the StatisticsFile, if one is set */
+static void
+stats_setup(ServerOptions *options, const char *filename, Buffer *conf)
+{
+	Buffer text;
+	int r;
+
+	stats_close();
+	free(match_stats);
+	match_stats = NULL;
+	if (options->statistics_file == NULL)
+		return;
+	buffer_init(&text);
+	match_stats_layout(&text, filename);
+	r = stats_open(options->statistics_file, &text, conf);
+	buffer_free(&text);
+	if (r == -1) {
+		free(match_stats);
+		match_stats = NULL;
+	}
+}
 
 void
 parse_server_config(ServerOptions *options, const char *filename, Buffer *conf,
     struct connection_info *connectinfo)
 {
-	int active, linenum, bad_options = 0;
+	struct {
+		const char *file;	/* where the Include was */
+		int	 linenum;	/* of the line after it */
+		int	 active;
+		struct match_block *block;
+	} inc[INCLUDE_MAX_DEPTH];
+	int active, linenum, depth = 0, bad_options = 0;
 	char *cp, *obuf, *cbuf;
+	const char *file = filename;
+	struct match_block *block = NULL;
 
 	debug2("%s: config %s len %d", __func__, filename, buffer_len(conf));
 
-	obuf = cbuf = xstrdup(buffer_ptr(conf));
+	/*
+	 * Compile Match blocks when parsing the main config. The compiled
+	 * options then refer into a new arena, which keeps this copy of the
+	 * text for the arguments to be used in place.
+	 */
+	if (connectinfo == NULL) {
+		match_blocks_clear();
+		config_generation++;
+		cfg_arena_begin();
+	}
+	obuf = cbuf = cfg_strdup(buffer_ptr(conf));
 	active = connectinfo ? 0 : 1;
 	linenum = 1;
 	while ((cp = strsep(&cbuf, "\n")) != NULL) {
-		if (process_server_config_line(options, cp, filename,
-		    linenum++, &active, connectinfo) != 0)
+		/*
+		 * An included file (see load_server_config()) is parsed as
+		 * though its lines replaced the Include, but numbered from
+		 * its own start. A Match started in it ends with it.
+		 */
+		if (*cp == INCLUDE_MARK && strncmp(cp + 1, "include ", 8) == 0) {
+			if (depth >= INCLUDE_MAX_DEPTH)
+				fatal("%s line %d: too many nested Include "
+				    "directives", file, linenum);
+			inc[depth].file = file;
+			inc[depth].linenum = linenum;
+			inc[depth].active = active;
+			inc[depth++].block = block;
+			file = cp + 9;
+			linenum = 1;
+			continue;
+		}
+		if (*cp == INCLUDE_MARK && strcmp(cp + 1, "end") == 0) {
+			if (depth == 0)
+				fatal("%s: unbalanced Include", filename);
+			file = inc[--depth].file;
+			linenum = inc[depth].linenum;
+			active = inc[depth].active;
+			if (connectinfo == NULL)
+				match_block_resume(&block, inc[depth].block);
+			continue;
+		}
+		if (process_server_config_line_block(options, cp, file,
+		    linenum++, &active, connectinfo,
+		    connectinfo == NULL ? &block : NULL) != 0)
 			bad_options++;
 	}
-	free(obuf);
+	if (depth != 0)
+		fatal("%s: unbalanced Include", filename);
+	cfg_free(obuf);
 	if (bad_options > 0)
 		fatal("%s: terminating, %d bad configuration options",
 		    filename, bad_options);
+	if (connectinfo == NULL) {
+		match_blocks_finalize(options);
+		group_cache_setup(options);
+		host_cache_setup(options);
+		auth_source_setup(options);
+		auth_action_setup();
+		stats_setup(options, filename, conf);
+		debug2("%s: config arena %zu bytes", __func__,
+		    cfg_arena_end());
+	}
+}
+
+/* Free what options owns, except for listen_addrs */
+static void
+free_server_options(ServerOptions *o)
+{
+#define FREE_STRARRAY(n, num_n) cfg_free_list(o->n, o->num_n)
+
+	free(o->ports);
+	cfg_free(o->listen_addr);
+	FREE_STRARRAY(queued_listen_addrs, num_queued_listens);
+	free(o->queued_listen_ports);
+	FREE_STRARRAY(host_key_files, num_host_key_files);
+	FREE_STRARRAY(host_cert_files, num_host_cert_files);
+	cfg_free(o->host_key_agent);
+	cfg_free(o->pid_file);
+	cfg_free(o->statistics_file);
+	cfg_free(o->auth_time_source_file);
+	cfg_free(o->xauth_location);
+	cfg_free(o->ciphers);
+	cfg_free(o->macs);
+	cfg_free(o->kex_algorithms);
+	FREE_STRARRAY(allow_users, num_allow_users);
+	FREE_STRARRAY(deny_users, num_deny_users);
+	FREE_STRARRAY(allow_groups, num_allow_groups);
+	FREE_STRARRAY(deny_groups, num_deny_groups);
+	FREE_STRARRAY(subsystem_name, num_subsystems);
+	FREE_STRARRAY(subsystem_command, num_subsystems);
+	FREE_STRARRAY(subsystem_args, num_subsystems);
+	FREE_STRARRAY(accept_env, num_accept_env);
+	cfg_free(o->banner);
+	FREE_STRARRAY(authorized_keys_files, num_authkeys_files);
+	cfg_free(o->adm_forced_command);
+	cfg_free(o->chroot_directory);
+	cfg_free(o->revoked_keys_file);
+	cfg_free(o->trusted_user_ca_keys);
+	cfg_free(o->authorized_principals_file);
+	cfg_free(o->authorized_keys_command);
+	cfg_free(o->authorized_keys_command_user);
+	cfg_free(o->version_addendum);
+	FREE_STRARRAY(auth_methods, num_auth_methods);
+#undef FREE_STRARRAY
 }
 
 static const char *
@@ -1874,6 +4501,10 @@ fmt_intarg(ServerOpCodes code, int val)
 		return fmt_multistate_int(val, multistate_privsep);
 	case sAllowTcpForwarding:
 		return fmt_multistate_int(val, multistate_tcpfwd);
+	case sAuthTimeDetection:
+		return fmt_multistate_int(val, multistate_authtimedetect);
+	case sAuthTimeAttackPolicy:
+		return fmt_multistate_int(val, multistate_authattack);
 	case sProtocol:
 		switch (val) {
 		case SSH_PROTO_1:
@@ -1914,6 +4545,12 @@ dump_cfg_int(ServerOpCodes code, int val)
 	printf("%s %d\n", lookup_opcode_name(code), val);
 }
 
+static void
+dump_cfg_double(ServerOpCodes code, double val)
+{
+	printf("%s %g\n", lookup_opcode_name(code), val);
+}
+
 static void
 dump_cfg_fmtint(ServerOpCodes code, int val)
 {
@@ -1948,6 +4585,17 @@ dump_cfg_strarray_oneline(ServerOpCodes code, u_int count, char **vals)
 	printf("\n");
 }
 
+static void
+dump_cache_counters(const char *name, struct shcache *c)
+{
+	u_int64_t hits, misses;
+
+	if (c == NULL || shcache_counters(c, &hits, &misses) != 0)
+		return;
+	printf("# %s hits %llu misses %llu\n", name,
+	    (unsigned long long)hits, (unsigned long long)misses);
+}
+
 void
 dump_config(ServerOptions *o)
 {
@@ -1956,6 +4604,18 @@ dump_config(ServerOptions *o)
 	struct addrinfo *ai;
 	char addr[NI_MAXHOST], port[NI_MAXSERV], *s = NULL;
 
+	if (test_batch.path != NULL && !test_batch.running) {
+		if (test_batch.jobs == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+			test_batch.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+			if (test_batch.jobs < 1)
+				test_batch.jobs = 1;
+		}
+		dump_config_batch(o);
+		return;
+	}
+
 	/* these are usually at the top of the config */
 	for (i = 0; i < o->num_ports; i++)
 		printf("port %d\n", o->ports[i]);
@@ -1990,6 +4650,21 @@ dump_config(ServerOptions *o)
 	dump_cfg_int(sMaxSessions, o->max_sessions);
 	dump_cfg_int(sClientAliveInterval, o->client_alive_interval);
 	dump_cfg_int(sClientAliveCountMax, o->client_alive_count_max);
+	dump_cfg_int(sMatchCacheSize, o->match_cache_size);
+	dump_cfg_int(sGroupCacheTime, o->group_cache_time);
+	dump_cfg_int(sHostnameCacheTime, o->hostname_cache_time);
+	dump_cfg_int(sHostnameLookupTimeout, o->hostname_lookup_timeout);
+	dump_cfg_int(sAuthTimeSources, o->auth_time_sources);
+	dump_cfg_int(sAuthTimeAttackMaxTries, o->auth_time_attack_max_tries);
+	dump_cfg_int(sAuthTimeAttackDisconnect,
+	    o->auth_time_attack_disconnect);
+
+	/* real arguments */
+	dump_cfg_double(sAuthTimeRTTFactor, o->auth_time_rtt_factor);
+	dump_cfg_double(sAuthTimeRTTFloor, o->auth_time_rtt_floor);
+	dump_cfg_double(sAuthTimeAttackDelay, o->auth_time_attack_delay);
+	printf("%s %g %g\n", lookup_opcode_name(sAuthTimeTarpit),
+	    o->auth_time_tarpit, o->auth_time_tarpit_max);
 
 	/* formatted integer arguments */
 	dump_cfg_fmtint(sPermitRootLogin, o->permit_root_login);
@@ -2033,9 +4708,13 @@ dump_config(ServerOptions *o)
 	dump_cfg_fmtint(sUseDNS, o->use_dns);
 	dump_cfg_fmtint(sAllowTcpForwarding, o->allow_tcp_forwarding);
 	dump_cfg_fmtint(sUsePrivilegeSeparation, use_privsep);
+	dump_cfg_fmtint(sAuthTimeDetection, o->auth_time_detection);
+	dump_cfg_fmtint(sAuthTimeAttackPolicy, o->auth_time_attack_policy);
 
 	/* string arguments */
 	dump_cfg_string(sPidFile, o->pid_file);
+	dump_cfg_string(sStatisticsFile, o->statistics_file);
+	dump_cfg_string(sAuthTimeSourceFile, o->auth_time_source_file);
 	dump_cfg_string(sXAuthLocation, o->xauth_location);
 	dump_cfg_string(sCiphers, o->ciphers ? o->ciphers :
 	    cipher_alg_list(',', 0));
@@ -2095,4 +4774,347 @@ dump_config(ServerOptions *o)
 	    o->rekey_interval);
 
 	channel_print_adm_permitted_opens();
+
+	dump_cache_counters("matchcache", match_cache);
+	dump_cache_counters("groupcache", group_cache);
+	dump_cache_counters("hostcache", host_cache);
+}
+
+/*
+ * Batch test mode, asked for with sshd -T -C batch=FILE: many connection
+ * specs, as given to sshd -T -C, are evaluated against the parsed
+ * configuration by a pool of worker processes. Each worker runs dump_config() with its stdout on a scratch
+ * file, and writes the lines for its share of a round of specs to its
+ * own output file. These are copied to stdout in spec order once the
+ * round is done.
+ */
+#define BATCH_SPECS_PER_WORKER	256
+#define BATCH_SPEC_MAX		1024
+
+/*
+ * Give o private copies of what applying Match blocks may replace and
+ * free, so that the options it was copied from are left intact.
+ */
+static void
+batch_options_private(ServerOptions *o)
+{
+#define M_CP_STROPT(n) do {\
+	if (o->n != NULL) \
+		o->n = xstrdup(o->n); \
+} while (0)
+#define M_CP_STRARRAYOPT_ALLOC(n, num_n) do {\
+	char **a = o->n; \
+	u_int i; \
+	if (o->num_n != 0) { \
+		o->n = xcalloc(o->num_n, sizeof(*o->n)); \
+		for (i = 0; i < o->num_n; i++) \
+			o->n[i] = xstrdup(a[i]); \
+	} \
+} while (0)
+	COPY_MATCH_STRING_OPTS();
+	M_CP_STROPT(adm_forced_command);
+	M_CP_STROPT(chroot_directory);
+#undef M_CP_STROPT
+#undef M_CP_STRARRAYOPT_ALLOC
+}
+
+/* Free what batch_options_private() or the Match blocks allocated */
+static void
+batch_options_release(ServerOptions *o)
+{
+#define M_CP_STROPT(n) cfg_free(o->n)
+#define M_CP_STRARRAYOPT_ALLOC(n, num_n) cfg_free_list(o->n, o->num_n)
+	COPY_MATCH_STRING_OPTS();
+	M_CP_STROPT(adm_forced_command);
+	M_CP_STROPT(chroot_directory);
+#undef M_CP_STROPT
+#undef M_CP_STRARRAYOPT_ALLOC
+}
+
+struct batch_lines {
+	char	*text;
+	char   **line;		/* in dump order */
+	char   **sorted;
+	u_int	 n;
+};
+
+static int
+batch_strcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+batch_lines_has(struct batch_lines *bl, char *line)
+{
+	return bsearch(&line, bl->sorted, bl->n, sizeof(*bl->sorted),
+	    batch_strcmp) != NULL;
+}
+
+static void
+batch_lines_free(struct batch_lines *bl)
+{
+	free(bl->text);
+	free(bl->line);
+	free(bl->sorted);
+	memset(bl, 0, sizeof(*bl));
+}
+
+/*
+ * Run dump_config() with stdout on a scratch file and collect the lines
+ * it printed, leaving out the comments, whose statistics vary.
+ */
+static void
+batch_dump_lines(ServerOptions *o, struct batch_lines *bl)
+{
+	struct stat st;
+	char *cp, *eol;
+	size_t len;
+
+	memset(bl, 0, sizeof(*bl));
+	fflush(stdout);
+	if (ftruncate(STDOUT_FILENO, 0) == -1 ||
+	    lseek(STDOUT_FILENO, 0, SEEK_SET) == -1)
+		fatal("%s: truncate: %s", __func__, strerror(errno));
+	dump_config(o);
+	fflush(stdout);
+	if (fstat(STDOUT_FILENO, &st) == -1)
+		fatal("%s: fstat: %s", __func__, strerror(errno));
+	len = st.st_size;
+	bl->text = xmalloc(len + 1);
+	if (pread(STDOUT_FILENO, bl->text, len, 0) != (ssize_t)len)
+		fatal("%s: short read", __func__);
+	bl->text[len] = '\0';
+	for (cp = bl->text; *cp != '\0'; cp = eol + 1) {
+		if ((eol = strchr(cp, '\n')) == NULL)
+			eol = cp + strlen(cp) - 1;
+		else
+			*eol = '\0';
+		if (*cp == '#' || *cp == '\0')
+			continue;
+		array_append(&bl->line, &bl->n, cp);
+	}
+	bl->sorted = xcalloc(bl->n + 1, sizeof(*bl->sorted));
+	memcpy(bl->sorted, bl->line, bl->n * sizeof(*bl->line));
+	qsort(bl->sorted, bl->n, sizeof(*bl->sorted), batch_strcmp);
+}
+
+/* Evaluate one spec and write the result to out */
+static void
+batch_eval(ServerOptions *options, const char *spec, FILE *out,
+    struct batch_lines *global)
+{
+	struct connection_info ci;
+	struct batch_lines bl;
+	ServerOptions o;
+	char *cp;
+	u_int i;
+
+	memset(&ci, 0, sizeof(ci));
+	cp = xstrdup(spec);
+	/* test_batch.running makes batch= and the like invalid here */
+	if (parse_server_match_testspec(&ci, cp) == -1 ||
+	    server_match_spec_complete(&ci) != 1) {
+		fprintf(out, "# invalid spec\n");
+		goto out;
+	}
+	o = *options;
+	batch_options_private(&o);
+	parse_server_match_config(&o, &ci);
+	batch_dump_lines(&o, &bl);
+	batch_options_release(&o);
+	if (global == NULL) {
+		for (i = 0; i < bl.n; i++)
+			fprintf(out, "%s\n", bl.line[i]);
+	} else {
+		for (i = 0; i < global->n; i++)
+			if (!batch_lines_has(&bl, global->line[i]))
+				fprintf(out, "-%s\n", global->line[i]);
+		for (i = 0; i < bl.n; i++)
+			if (!batch_lines_has(global, bl.line[i]))
+				fprintf(out, "+%s\n", bl.line[i]);
+	}
+	batch_lines_free(&bl);
+ out:
+	free((char *)ci.user);
+	free((char *)ci.host);
+	free((char *)ci.address);
+	free((char *)ci.laddress);
+	free(cp);
+}
+
+/* Evaluate specs[0..nspecs) and write the results to out */
+static void
+batch_worker(ServerOptions *options, char **specs, u_int nspecs, FILE *out,
+    int diff)
+{
+	struct batch_lines global;
+	struct match_block *b;
+	FILE *scratch;
+	pid_t pid;
+	u_int i;
+	int status, isolate = 0;
+
+	/* dump_config() and channels.c print to stdout, so capture that */
+	fflush(stdout);
+	if ((scratch = tmpfile()) == NULL ||
+	    dup2(fileno(scratch), STDOUT_FILENO) == -1)
+		fatal("%s: scratch file: %s", __func__, strerror(errno));
+	if (diff)
+		batch_dump_lines(options, &global);
+
+	/*
+	 * PermitOpen in a Match block changes the state of channels.c,
+	 * which cannot be reset, so evaluate each spec in its own process.
+	 */
+	TAILQ_FOREACH(b, &match_blocks, next)
+		if (b->nreplay > 0)
+			isolate = 1;
+
+	for (i = 0; i < nspecs; i++) {
+		fprintf(out, "# spec %s\n", specs[i]);
+		if (!isolate) {
+			batch_eval(options, specs[i], out,
+			    diff ? &global : NULL);
+			continue;
+		}
+		fflush(out);
+		if ((pid = fork()) == -1)
+			fatal("%s: fork: %s", __func__, strerror(errno));
+		if (pid == 0) {
+			batch_eval(options, specs[i], out,
+			    diff ? &global : NULL);
+			if (fflush(out) != 0)
+				_exit(1);
+			_exit(0);
+		}
+		while (waitpid(pid, &status, 0) == -1)
+			if (errno != EINTR)
+				fatal("%s: waitpid: %s", __func__,
+				    strerror(errno));
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fatal("%s: evaluation of \"%s\" failed", __func__,
+			    specs[i]);
+	}
+	if (fflush(out) != 0)
+		fatal("%s: write: %s", __func__, strerror(errno));
+}
+
+static void
+batch_copy(FILE *from, FILE *to)
+{
+	char buf[8192];
+	size_t len;
+
+	while ((len = fread(buf, 1, sizeof(buf), from)) > 0)
+		if (fwrite(buf, 1, len, to) != len)
+			fatal("%s: write: %s", __func__, strerror(errno));
+	if (ferror(from))
+		fatal("%s: read: %s", __func__, strerror(errno));
+}
+
+/* Read the next spec from in, skipping blank and comment lines */
+static char *
+batch_read_spec(FILE *in)
+{
+	char buf[BATCH_SPEC_MAX], *cp;
+
+	while (fgets(buf, sizeof(buf), in) != NULL) {
+		if (strchr(buf, '\n') == NULL && !feof(in))
+			fatal("connection spec too long");
+		buf[strcspn(buf, "\r\n")] = '\0';
+		cp = buf + strspn(buf, WHITESPACE);
+		if (*cp == '\0' || *cp == '#')
+			continue;
+		return xstrdup(cp);
+	}
+	return NULL;
+}
+
+/*
+ * Evaluate each connection spec read from the batch file, one per line,
+ * against the configuration in options, printing the effective settings
+ * for each as sshd -T would, after a "# spec" line. With format=diff,
+ * print only how they differ from the global settings: "-" lines for
+ * global settings a spec loses and "+" lines for those it gains. Specs
+ * are shared among jobs processes.
+ */
+static void
+dump_config_batch(ServerOptions *options)
+{
+	char **specs = NULL, *spec;
+	u_int nspecs, i, first, last;
+	FILE *in, **out;
+	pid_t *pids;
+	sigset_t nset, oset;
+	int status, eof = 0, nworkers = test_batch.jobs;
+	int diff = test_batch.diff;
+
+	test_batch.running = 1;
+	if (strcmp(test_batch.path, "-") == 0)
+		in = stdin;
+	else if ((in = fopen(test_batch.path, "r")) == NULL)
+		fatal("%s: %s", test_batch.path, strerror(errno));
+	out = xcalloc(nworkers, sizeof(*out));
+	pids = xcalloc(nworkers, sizeof(*pids));
+	sigemptyset(&nset);
+	sigaddset(&nset, SIGCHLD);
+	fflush(stdout);
+
+	while (!eof) {
+		nspecs = 0;
+		while (nspecs < (u_int)nworkers * BATCH_SPECS_PER_WORKER) {
+			if ((spec = batch_read_spec(in)) == NULL) {
+				eof = 1;
+				break;
+			}
+			array_append(&specs, &nspecs, spec);
+		}
+		if (nspecs == 0)
+			break;
+
+		sigprocmask(SIG_BLOCK, &nset, &oset);
+		for (i = 0; i < (u_int)nworkers; i++) {
+			first = (nspecs * i) / nworkers;
+			last = (nspecs * (i + 1)) / nworkers;
+			pids[i] = -1;
+			if (first == last)
+				continue;
+			if ((out[i] = tmpfile()) == NULL)
+				fatal("%s: tmpfile: %s", __func__,
+				    strerror(errno));
+			if ((pids[i] = fork()) == -1)
+				fatal("%s: fork: %s", __func__,
+				    strerror(errno));
+			if (pids[i] == 0) {
+				batch_worker(options, specs + first,
+				    last - first, out[i], diff);
+				_exit(0);
+			}
+		}
+		for (i = 0; i < (u_int)nworkers; i++) {
+			if (pids[i] == -1)
+				continue;
+			while (waitpid(pids[i], &status, 0) == -1)
+				if (errno != EINTR)
+					fatal("%s: waitpid: %s", __func__,
+					    strerror(errno));
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				fatal("%s: worker failed", __func__);
+			rewind(out[i]);
+			batch_copy(out[i], stdout);
+			fclose(out[i]);
+		}
+		sigprocmask(SIG_SETMASK, &oset, NULL);
+		if (fflush(stdout) != 0)
+			fatal("%s: write: %s", __func__, strerror(errno));
+		for (i = 0; i < nspecs; i++)
+			free(specs[i]);
+		free(specs);
+		specs = NULL;
+	}
+	if (in != stdin)
+		fclose(in);
+	free(out);
+	free(pids);
 }
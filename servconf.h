@@ -16,20 +16,6 @@
 #ifndef SERVCONF_H
 #define SERVCONF_H
 
-#define MAX_PORTS		256	/* Max # ports. */
-
-#define MAX_ALLOW_USERS		256	/* Max # users on allow list. */
-#define MAX_DENY_USERS		256	/* Max # users on deny list. */
-#define MAX_ALLOW_GROUPS	256	/* Max # groups on allow list. */
-#define MAX_DENY_GROUPS		256	/* Max # groups on deny list. */
-#define MAX_SUBSYSTEMS		256	/* Max # subsystems. */
-#define MAX_HOSTKEYS		256	/* Max # hostkeys. */
-#define MAX_HOSTCERTS		256	/* Max # host certificates. */
-#define MAX_ACCEPT_ENV		256	/* Max # of env vars. */
-#define MAX_MATCH_GROUPS	256	/* Max # of groups for Match. */
-#define MAX_AUTHKEYS_FILES	256	/* Max # of authorized_keys files. */
-#define MAX_AUTH_METHODS	256	/* Max # of AuthenticationMethods. */
-
 /* permit_root_login */
 #define	PERMIT_NOT_SET		-1
 #define	PERMIT_NO		0
@@ -57,6 +43,36 @@
 /* 認証時間しきい値のデフォルト値 */
 #define DEFAULT_AUTH_TIME_THRESHOLD  0.8
 
+/* AuthTimeDetection */
+#define AUTH_TIME_DETECT_FIXED		0	/* AuthTimeThreshold only */
+#define AUTH_TIME_DETECT_ADAPTIVE	1	/* per-source baselines */
+#define AUTH_TIME_DETECT_RTT		2	/* less the KEX round trips */
+
+/* AuthTimeAttackPolicy */
+#define AUTH_ATTACK_NONE	0	/* verify as usual */
+#define AUTH_ATTACK_DELAY	1	/* wait before verifying */
+#define AUTH_ATTACK_REJECT	2	/* fail without verifying */
+
+/* Actions counted for attempts judged an attack */
+#define AUTH_ACT_FLAGGED	0	/* attempts judged an attack */
+#define AUTH_ACT_DELAYED	1	/* AUTH_ATTACK_DELAY applied */
+#define AUTH_ACT_REJECTED	2	/* AUTH_ATTACK_REJECT applied */
+#define AUTH_ACT_TARPITTED	3	/* failure reply held back */
+#define AUTH_ACT_MAXTRIES	4	/* AuthTimeAttackMaxTries reached */
+#define AUTH_ACT_DISCONNECTED	5	/* AuthTimeAttackDisconnect reached */
+#define AUTH_ACT_MAX		6
+
+#define DEFAULT_AUTH_TIME_SOURCES	16384	/* sources tracked */
+#define _PATH_SSHD_AUTH_SOURCES		_PATH_SSH_PIDDIR "/sshd.authsources"
+#define _PATH_SSHD_AUTH_ACTIONS		_PATH_SSH_PIDDIR "/sshd.authactions"
+#define _PATH_SSHD_MATCH_CACHE		_PATH_SSH_PIDDIR "/sshd.matchcache"
+#define _PATH_SSHD_GROUP_CACHE		_PATH_SSH_PIDDIR "/sshd.groupcache"
+#define _PATH_SSHD_HOST_CACHE		_PATH_SSH_PIDDIR "/sshd.hostcache"
+#define DEFAULT_AUTH_TIME_TARPIT_MAX	30.0	/* secs */
+#define DEFAULT_AUTH_TIME_ATTACK_DELAY	1.0	/* secs */
+#define DEFAULT_AUTH_TIME_RTT_FACTOR	1.0	/* round trips discounted */
+#define DEFAULT_AUTH_TIME_RTT_FLOOR	0.0	/* secs left at least */
+
 /*double* AuthTimeThreshold; /* 認証時間しきい値格納用変数 */
 extern double AuthTimeThreshold; //認証時間しきい値格納用変数
 /*double* AuthTimeThreshold; */
@@ -64,14 +80,17 @@ extern double AuthTimeThreshold; //認証時間しきい値格納用変数
 typedef struct {
 	u_int	num_ports;
 	u_int	ports_from_cmdline;
-	int	ports[MAX_PORTS];	/* Port number to listen on. */
+	int    *ports;		/* Port numbers to listen on. */
 	char   *listen_addr;		/* Address on which the server listens. */
 	struct addrinfo *listen_addrs;	/* Addresses on which the server listens. */
+	char  **queued_listen_addrs;	/* ListenAddress entries to resolve */
+	int    *queued_listen_ports;
+	u_int	num_queued_listens;
 	int     address_family;		/* Address family used by the server. */
-	char   *host_key_files[MAX_HOSTKEYS];	/* Files containing host keys. */
-	int     num_host_key_files;     /* Number of files for host keys. */
-	char   *host_cert_files[MAX_HOSTCERTS];	/* Files containing host certs. */
-	int     num_host_cert_files;     /* Number of files for host certs. */
+	char  **host_key_files;	/* Files containing host keys. */
+	u_int   num_host_key_files;     /* Number of files for host keys. */
+	char  **host_cert_files;	/* Files containing host certs. */
+	u_int   num_host_cert_files;     /* Number of files for host certs. */
 	char   *host_key_agent;		 /* ssh-agent socket for host keys. */
 	char   *pid_file;	/* Where to put our pid */
 	int     server_key_bits;/* Size of the server key. */
@@ -132,21 +151,21 @@ typedef struct {
 	int	allow_tcp_forwarding; /* One of FORWARD_* */
 	int	allow_agent_forwarding;
 	u_int num_allow_users;
-	char   *allow_users[MAX_ALLOW_USERS];
+	char  **allow_users;
 	u_int num_deny_users;
-	char   *deny_users[MAX_DENY_USERS];
+	char  **deny_users;
 	u_int num_allow_groups;
-	char   *allow_groups[MAX_ALLOW_GROUPS];
+	char  **allow_groups;
 	u_int num_deny_groups;
-	char   *deny_groups[MAX_DENY_GROUPS];
+	char  **deny_groups;
 
 	u_int num_subsystems;
-	char   *subsystem_name[MAX_SUBSYSTEMS];
-	char   *subsystem_command[MAX_SUBSYSTEMS];
-	char   *subsystem_args[MAX_SUBSYSTEMS];
+	char  **subsystem_name;
+	char  **subsystem_command;
+	char  **subsystem_args;
 
 	u_int num_accept_env;
-	char   *accept_env[MAX_ACCEPT_ENV];
+	char  **accept_env;
 
 	int	max_startups_begin;
 	int	max_startups_rate;
@@ -166,7 +185,7 @@ typedef struct {
 					 */
 
 	u_int num_authkeys_files;	/* Files containing public keys */
-	char   *authorized_keys_files[MAX_AUTHKEYS_FILES];
+	char  **authorized_keys_files;
 
 	char   *adm_forced_command;
 
@@ -189,10 +208,36 @@ typedef struct {
 	char   *version_addendum;	/* Appended to SSH banner */
 
 	u_int	num_auth_methods;
-	char   *auth_methods[MAX_AUTH_METHODS];
+	char  **auth_methods;
+
+	int	match_cache_size;	/* # cached Match results, 0 = off */
+	int	group_cache_time;	/* secs group lists are cached, 0 = off */
+	int	hostname_cache_time;	/* secs host names are cached, 0 = off */
+	int	hostname_lookup_timeout; /* secs allowed for a lookup, 0 = none */
+	char   *statistics_file;	/* text file counts are kept in */
 	double auth_time_threshold; /* 認証時間しきい値の宣言 */
+	int	auth_time_detection;	/* AUTH_TIME_DETECT_* */
+	int	auth_time_sources;	/* # sources with statistics kept */
+	char   *auth_time_source_file;	/* file they are kept in, or "none" */
+	double	auth_time_rtt_factor;	/* RTTs taken off the attempt time */
+	double	auth_time_rtt_floor;	/* secs it is not taken below */
+	int	auth_time_attack_policy; /* AUTH_ATTACK_* */
+	double	auth_time_attack_delay;	/* secs for AUTH_ATTACK_DELAY */
+	int	auth_time_attack_max_tries; /* once flagged, 0 = MaxAuthTries */
+	int	auth_time_attack_disconnect; /* flagged attempts, 0 = none */
+	double	auth_time_tarpit;	/* secs first failure held, 0 = off */
+	double	auth_time_tarpit_max;	/* secs at most */
 }       ServerOptions;
 
+/* Authentication time statistics for one source address */
+struct auth_source_stats {
+	double	  mean;		/* moving average of attempt time, secs */
+	double	  var;		/* moving variance of attempt time */
+	double	  rate;		/* recent attempts per second */
+	u_int64_t last;		/* monotonic nsec of the last attempt */
+	u_int32_t samples;	/* attempts seen */
+};
+
 /* Information about the incoming connection as used by Match */
 struct connection_info {
 	const char *user;
@@ -211,6 +256,11 @@ struct connection_info {
  *
  * NB. an option must appear in servconf.c:copy_set_server_options() or
  * COPY_MATCH_STRING_OPTS here but never both.
+ *
+ * The string arrays are allocated, so every user must define
+ * M_CP_STRARRAYOPT_ALLOC.  One that receives the arrays into a copied
+ * ServerOptions must allocate each destination array before filling it,
+ * as the copy's array pointers are those of the sender.
  */
 #define COPY_MATCH_STRING_OPTS() do { \
 		M_CP_STROPT(banner); \
@@ -219,16 +269,17 @@ struct connection_info {
 		M_CP_STROPT(authorized_principals_file); \
 		M_CP_STROPT(authorized_keys_command); \
 		M_CP_STROPT(authorized_keys_command_user); \
-		M_CP_STRARRAYOPT(authorized_keys_files, num_authkeys_files); \
-		M_CP_STRARRAYOPT(allow_users, num_allow_users); \
-		M_CP_STRARRAYOPT(deny_users, num_deny_users); \
-		M_CP_STRARRAYOPT(allow_groups, num_allow_groups); \
-		M_CP_STRARRAYOPT(deny_groups, num_deny_groups); \
-		M_CP_STRARRAYOPT(accept_env, num_accept_env); \
-		M_CP_STRARRAYOPT(auth_methods, num_auth_methods); \
+		M_CP_STRARRAYOPT_ALLOC(authorized_keys_files, num_authkeys_files); \
+		M_CP_STRARRAYOPT_ALLOC(allow_users, num_allow_users); \
+		M_CP_STRARRAYOPT_ALLOC(deny_users, num_deny_users); \
+		M_CP_STRARRAYOPT_ALLOC(allow_groups, num_allow_groups); \
+		M_CP_STRARRAYOPT_ALLOC(deny_groups, num_deny_groups); \
+		M_CP_STRARRAYOPT_ALLOC(accept_env, num_accept_env); \
+		M_CP_STRARRAYOPT_ALLOC(auth_methods, num_auth_methods); \
 	} while (0)
 
 struct connection_info *get_connection_info(int, int);
+const char *server_canonical_hostname(int);
 void	 initialize_server_options(ServerOptions *);
 void	 fill_default_server_options(ServerOptions *);
 int	 process_server_config_line(ServerOptions *, char *, const char *, int,
@@ -240,7 +291,24 @@ void	 parse_server_match_config(ServerOptions *, struct connection_info *);
 int	 parse_server_match_testspec(struct connection_info *, char *);
 int	 server_match_spec_complete(struct connection_info *);
 void	 copy_set_server_options(ServerOptions *, ServerOptions *, int);
+void	 servconf_add_port(ServerOptions *, int);
+void	 servconf_add_hostkey(ServerOptions *, const char *);
+int	 server_match_user_list(ServerOptions *, int, const char *,
+	     const char *, const char *);
+int	 server_match_group_list(ServerOptions *, int, const char *, gid_t);
+int	 server_accept_env(ServerOptions *, const char *);
 void	 dump_config(ServerOptions *);
+const char *server_keyword_name(u_int);
+int	 server_keyword_lookup(const char *);
+int	 auth_source_update(const char *, double, struct auth_source_stats *);
+/* auth-time.c: the monitor requests of the authentication time detector */
+int	 mm_auth_source_update(double, struct auth_source_stats *);
+int	 mm_answer_auth_source(int, Buffer *);
+void	 mm_auth_attack_count(u_int);
+int	 mm_answer_auth_action(int, Buffer *);
+void	 auth_attack_count(u_int);
+void	 dump_auth_attack_stats(FILE *);
 char	*derelativise_path(const char *);
+u_int64_t monotime_nsec(void);
 
 #endif				/* SERVCONF_H */
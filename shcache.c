@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "misc.h"
+#include "shfile.h"
+#include "shcache.h"
+
+/*
+ * A bounded, set-associative cache of small key/value entries.  Without
+ * privilege separation it is held in memory shared with the children
+ * forked after it is created, so that a result computed in one child is
+ * available to the next.  With privilege separation the unprivileged
+ * child would inherit write access to that memory, and could plant the
+ * entries the monitor trusts for later connections, so the caller then
+ * asks shcache_new() for a cache private to each process.  Each slot carries a checksum: a slot torn by
+ * concurrent writers fails it and reads as a miss.  The counters are
+ * advisory and may lose updates.
+ *
+ * A cache may instead be kept in a file (see shcache_open()), to be shared
+ * by every connection however it was started, re-executed children
+ * included.  The file is not mapped: it is read and written, counters
+ * included, through a descriptor opened for each operation, which only a
+ * process with the privileges of its owner can get; under privilege
+ * separation, that is the monitor.  In an unprivileged child every lookup
+ * misses and nothing is stored.  Entries in a file are stamped with the
+ * time of day rather than monotime(), which does not carry across a reboot.
+ */
+#define SHCACHE_WAYS		4
+#define SHCACHE_MAX_ENTRIES	(1024 * 1024)
+
+struct shcache_hdr {
+	u_int64_t layout;	/* geometry, checked when taking up a file */
+	u_int64_t tag;		/* what the entries depend on, likewise */
+	char	  owner[SHFILE_OWNER_LEN];	/* see shfile_open() */
+	u_int64_t hits;
+	u_int64_t misses;
+};
+
+struct shcache_slot {
+	u_int32_t check;	/* checksum of the remainder of the slot */
+	u_int32_t keyhash;
+	time_t	  stamp;	/* shcache_now() when stored */
+	u_int16_t klen;		/* 0 for an empty slot */
+	u_int16_t vlen;
+	/* followed by keymax bytes of key and valmax bytes of value */
+};
+
+struct shcache {
+	struct shcache_hdr *hdr;	/* in memory, or NULL */
+	u_int	 nsets;
+	size_t	 keymax, valmax, slotlen, maplen;
+	char	*path;		/* file kept in, or NULL if in memory */
+	dev_t	 dev;		/* and its identity */
+	ino_t	 ino;
+};
+
+u_int32_t
+fnv1a(u_int32_t h, const void *p, size_t len)
+{
+	const u_char *cp = p;
+
+	while (len-- > 0)
+		h = (h ^ *cp++) * 16777619U;
+	return h;
+}
+
+static struct shcache *
+shcache_alloc(u_int nentries, size_t keymax, size_t valmax)
+{
+	struct shcache *c;
+
+	if (nentries == 0 || nentries > SHCACHE_MAX_ENTRIES ||
+	    keymax > 0xffff || valmax > 0xffff)
+		fatal("%s: bad cache size %u/%zu/%zu", __func__, nentries,
+		    keymax, valmax);
+	c = xcalloc(1, sizeof(*c));
+	c->nsets = (nentries + SHCACHE_WAYS - 1) / SHCACHE_WAYS;
+	c->keymax = keymax;
+	c->valmax = valmax;
+	c->slotlen = roundup(sizeof(struct shcache_slot) + keymax + valmax,
+	    sizeof(u_int64_t));
+	c->maplen = sizeof(struct shcache_hdr) +
+	    (size_t)c->nsets * SHCACHE_WAYS * c->slotlen;
+	return c;
+}
+
+/*
+ * Make a cache in memory, shared with the children forked later if shared
+ * is set. Returns NULL if it cannot be made.
+ */
+struct shcache *
+shcache_new(u_int nentries, size_t keymax, size_t valmax, int shared)
+{
+#if defined(HAVE_MMAP) && defined(MAP_ANON) && defined(MAP_SHARED)
+	struct shcache *c;
+	void *p;
+	int share = shared ? MAP_SHARED : MAP_PRIVATE;
+
+	c = shcache_alloc(nentries, keymax, valmax);
+	p = mmap(NULL, c->maplen, PROT_READ|PROT_WRITE, MAP_ANON|share,
+	    -1, (off_t)0);
+	if (p == MAP_FAILED) {
+		error("%s: mmap(%zu): %s", __func__, c->maplen,
+		    strerror(errno));
+		free(c);
+		return NULL;
+	}
+	c->hdr = p;
+	return c;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * As shcache_new(), but kept in the file at path. A file laid out for
+ * another cache, or holding entries for another tag, is replaced with an
+ * empty one (see shfile_open()). what names the cache in messages.
+ */
+struct shcache *
+shcache_open(const char *path, u_int nentries, size_t keymax,
+    size_t valmax, u_int64_t tag, const char *what)
+{
+	struct shcache *c;
+	struct shcache_hdr *init;
+	struct stat st;
+	int fd;
+
+	c = shcache_alloc(nentries, keymax, valmax);
+	init = xcalloc(1, c->maplen);
+	init->layout = ((u_int64_t)c->nsets << 32) | (keymax << 16) | valmax;
+	init->tag = tag;
+	fd = shfile_open(path, init, c->maplen, offsetof(struct shcache_hdr,
+	    owner), &st, what);
+	free(init);
+	if (fd == -1) {
+		free(c);
+		return NULL;
+	}
+	close(fd);
+	c->path = xstrdup(path);
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	return c;
+}
+
+void
+shcache_free(struct shcache *c)
+{
+	if (c == NULL)
+		return;
+#if defined(HAVE_MMAP) && defined(MAP_SHARED)
+	if (c->hdr != NULL && munmap(c->hdr, c->maplen) == -1)
+		error("%s: munmap: %s", __func__, strerror(errno));
+#endif
+	free(c->path);
+	free(c);
+}
+
+static time_t
+shcache_now(struct shcache *c)
+{
+	return c->path != NULL ? time(NULL) : monotime();
+}
+
+/* Open the file of a file cache for an operation (see shfile_reopen()) */
+static int
+shcache_file(struct shcache *c)
+{
+	return shfile_reopen(c->path, c->dev, c->ino, O_RDWR);
+}
+
+static off_t
+shcache_set_off(struct shcache *c, u_int set)
+{
+	return sizeof(struct shcache_hdr) +
+	    (off_t)set * SHCACHE_WAYS * c->slotlen;
+}
+
+/* Copy the slots of a set to buf, which holds SHCACHE_WAYS of them */
+static int
+shcache_read_set(struct shcache *c, int fd, u_int set, u_char *buf)
+{
+	size_t len = SHCACHE_WAYS * c->slotlen;
+
+	if (c->path == NULL) {
+		/* Work on a private copy; the original may change under us */
+		memcpy(buf, (u_char *)c->hdr + shcache_set_off(c, set), len);
+		return 0;
+	}
+	if (pread(fd, buf, len, shcache_set_off(c, set)) != (ssize_t)len) {
+		debug3("%s: read %s: %s", __func__, c->path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Add one to the counter at offset off in the header */
+static void
+shcache_count(struct shcache *c, int fd, size_t off)
+{
+	u_int64_t n;
+
+	if (c->path == NULL) {
+		(*(u_int64_t *)((u_char *)c->hdr + off))++;
+		return;
+	}
+	if (pread(fd, &n, sizeof(n), off) != sizeof(n))
+		return;
+	n++;
+	if (pwrite(fd, &n, sizeof(n), off) != sizeof(n))
+		debug3("%s: write %s: %s", __func__, c->path, strerror(errno));
+}
+
+/* Fetch the counters of a cache. Returns -1 if they cannot be read */
+int
+shcache_counters(struct shcache *c, u_int64_t *hits, u_int64_t *misses)
+{
+	struct shcache_hdr hdr;
+	int fd, r = 0;
+
+	if (c->path == NULL) {
+		*hits = c->hdr->hits;
+		*misses = c->hdr->misses;
+		return 0;
+	}
+	if ((fd = shcache_file(c)) == -1)
+		return -1;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		r = -1;
+	close(fd);
+	*hits = hdr.hits;
+	*misses = hdr.misses;
+	return r;
+}
+
+static u_int32_t
+shcache_checksum(struct shcache *c, const u_char *slot)
+{
+	size_t off = sizeof(((struct shcache_slot *)NULL)->check);
+
+	return fnv1a(FNV1A_INIT, slot + off, c->slotlen - off);
+}
+
+/*
+ * Look up key in the cache, ignoring entries older than ttl seconds
+ * (if non-zero). On a hit, copies at most vmax bytes of the value to val,
+ * sets *vlenp and returns 0. Returns -1 on a miss.
+ */
+int
+shcache_get(struct shcache *c, const void *key, size_t klen, void *val,
+    size_t vmax, size_t *vlenp, time_t ttl)
+{
+	struct shcache_slot *slot;
+	u_char *set, *cp;
+	u_int32_t h;
+	u_int i;
+	time_t now;
+	int fd = -1, r = -1;
+
+	if (c->path != NULL && (fd = shcache_file(c)) == -1)
+		return -1;
+	if (klen == 0 || klen > c->keymax) {
+		shcache_count(c, fd, offsetof(struct shcache_hdr, misses));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	h = fnv1a(FNV1A_INIT, key, klen);
+	set = xmalloc(SHCACHE_WAYS * c->slotlen);
+	if (shcache_read_set(c, fd, h % c->nsets, set) != 0)
+		i = SHCACHE_WAYS;
+	else
+		i = 0;
+	now = shcache_now(c);
+	for (; i < SHCACHE_WAYS; i++) {
+		cp = set + i * c->slotlen;
+		slot = (struct shcache_slot *)cp;
+		if (slot->keyhash != h || slot->klen != klen ||
+		    slot->vlen > c->valmax || slot->vlen > vmax ||
+		    slot->check != shcache_checksum(c, cp) ||
+		    memcmp(cp + sizeof(*slot), key, klen) != 0)
+			continue;
+		if (ttl > 0 && (now < slot->stamp || now - slot->stamp >= ttl))
+			break;
+		memcpy(val, cp + sizeof(*slot) + c->keymax, slot->vlen);
+		*vlenp = slot->vlen;
+		r = 0;
+		break;
+	}
+	free(set);
+	shcache_count(c, fd, r == 0 ? offsetof(struct shcache_hdr, hits) :
+	    offsetof(struct shcache_hdr, misses));
+	if (fd != -1)
+		close(fd);
+	return r;
+}
+
+/*
+ * Store a value in the cache, replacing any entry for the same key or
+ * else the oldest entry in its set.
+ */
+void
+shcache_put(struct shcache *c, const void *key, size_t klen, const void *val,
+    size_t vlen)
+{
+	struct shcache_slot *slot, *victim;
+	u_char *set, *copy;
+	u_int32_t h;
+	u_int i;
+	int fd = -1;
+
+	if (klen == 0 || klen > c->keymax || vlen > c->valmax)
+		return;
+	if (c->path != NULL && (fd = shcache_file(c)) == -1)
+		return;
+	h = fnv1a(FNV1A_INIT, key, klen);
+	set = xmalloc(SHCACHE_WAYS * c->slotlen);
+	if (shcache_read_set(c, fd, h % c->nsets, set) != 0) {
+		free(set);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	victim = (struct shcache_slot *)set;
+	for (i = 0; i < SHCACHE_WAYS; i++) {
+		slot = (struct shcache_slot *)(set + i * c->slotlen);
+		if (slot->klen == 0 ||
+		    (slot->keyhash == h && slot->klen == klen)) {
+			victim = slot;
+			break;
+		}
+		if (slot->stamp < victim->stamp)
+			victim = slot;
+	}
+	copy = xcalloc(1, c->slotlen);
+	slot = (struct shcache_slot *)copy;
+	slot->keyhash = h;
+	slot->stamp = shcache_now(c);
+	slot->klen = klen;
+	slot->vlen = vlen;
+	memcpy(copy + sizeof(*slot), key, klen);
+	memcpy(copy + sizeof(*slot) + c->keymax, val, vlen);
+	slot->check = shcache_checksum(c, copy);
+	i = ((u_char *)victim - set) / c->slotlen;
+	if (c->path == NULL)
+		memcpy((u_char *)c->hdr + shcache_set_off(c, h % c->nsets) +
+		    i * c->slotlen, copy, c->slotlen);
+	else {
+		if (pwrite(fd, copy, c->slotlen, shcache_set_off(c,
+		    h % c->nsets) + i * c->slotlen) != (ssize_t)c->slotlen)
+			debug3("%s: write %s: %s", __func__, c->path,
+			    strerror(errno));
+		close(fd);
+	}
+	free(copy);
+	free(set);
+}
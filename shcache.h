@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SHCACHE_H
+#define _SHCACHE_H
+
+#define FNV1A_INIT	2166136261U
+
+struct shcache;
+
+u_int32_t fnv1a(u_int32_t, const void *, size_t);
+
+struct shcache *shcache_new(u_int, size_t, size_t, int);
+struct shcache *shcache_open(const char *, u_int, size_t, size_t, u_int64_t,
+	    const char *);
+void	 shcache_free(struct shcache *);
+int	 shcache_counters(struct shcache *, u_int64_t *, u_int64_t *);
+int	 shcache_get(struct shcache *, const void *, size_t, void *, size_t,
+	    size_t *, time_t);
+void	 shcache_put(struct shcache *, const void *, size_t, const void *,
+	    size_t);
+
+#endif /* _SHCACHE_H */
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Files shared by every sshd process that parses the same configuration:
+ * the file caches (see shcache.c), the statistics file (see statsfile.c)
+ * and the counts of the authentication time detector. Each starts with
+ * bytes identifying its layout, and only a process with the privileges of
+ * its owner may update it.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "atomicio.h"
+#include "shfile.h"
+
+/* Returns 0 if st is owned by root or us and only writable by its owner */
+static int
+shfile_secure(struct stat *st)
+{
+	if (st->st_uid != 0 && st->st_uid != getuid())
+		return -1;
+	return (st->st_mode & (S_IWGRP|S_IWOTH)) != 0 ? -1 : 0;
+}
+
+/*
+ * Returns 1 if the file open on fd, of size bytes, belongs to a process
+ * other than this one that is still running. Any other file may be
+ * replaced.
+ */
+static int
+shfile_owner_alive(int fd, off_t size, size_t idlen)
+{
+	char field[SHFILE_OWNER_LEN + 1];
+	const char *errstr;
+	long long owner;
+
+	if (size < (off_t)(idlen + SHFILE_OWNER_LEN) ||
+	    pread(fd, field, SHFILE_OWNER_LEN, idlen) != SHFILE_OWNER_LEN)
+		return 0;
+	field[SHFILE_OWNER_LEN] = '\0';
+	owner = strtonum(field + strspn(field, " "), 1, INT_MAX, &errstr);
+	if (errstr != NULL || (pid_t)owner == getpid())
+		return 0;
+	return kill((pid_t)owner, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Open the file at path read-only, setting it up first if need be. Once
+ * set up the file holds the len bytes at init, of which the first idlen
+ * identify its layout; the SHFILE_OWNER_LEN bytes after them
+ * are filled in with the pid of the process that creates it. An existing
+ * file is taken up as it is if it is a regular file of that size starting
+ * with the same idlen bytes. Otherwise it is replaced, through a rename so
+ * that processes still mapping the old one are unaffected, unless another
+ * process that is still running created it: a process parsing a different
+ * configuration (sshd -t on an edited file, say) then does without it
+ * rather than discard what the running sshd has stored. Neither the file
+ * nor its directory may be writable by others. Stores the file's identity
+ * to *stp. Returns -1, having logged why, if the file cannot be used; what
+ * names it in the message.
+ */
+int
+shfile_open(const char *path, const void *init, size_t len, size_t idlen,
+    struct stat *stp, const char *what)
+{
+	struct stat st;
+	char *dir, *cp, *tmp, owner[SHFILE_OWNER_LEN + 1];
+	const u_char *ip = init;
+	size_t rest = len - idlen - SHFILE_OWNER_LEN;
+	u_char *id;
+	int fd, created = 0;
+
+	/* path is absolute, as parsed */
+	dir = xstrdup(path);
+	cp = strrchr(dir, '/');
+	if (cp == dir)
+		cp++;
+	*cp = '\0';
+	if (stat(dir, &st) == -1 || shfile_secure(&st) != 0) {
+		logit("%s unavailable: bad ownership or modes for the "
+		    "directory of %s", what, path);
+		free(dir);
+		return -1;
+	}
+	free(dir);
+
+	id = xmalloc(idlen);
+ again:
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW)) != -1) {
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		    shfile_secure(&st) != 0) {
+			close(fd);
+			fd = -1;
+		} else if (st.st_size != (off_t)len ||
+		    pread(fd, id, idlen, 0) != (ssize_t)idlen ||
+		    memcmp(id, init, idlen) != 0) {
+			if (!created && shfile_owner_alive(fd, st.st_size,
+			    idlen)) {
+				logit("%s unavailable: %s is in use by "
+				    "another sshd configuration", what, path);
+				close(fd);
+				free(id);
+				return -1;
+			}
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd == -1 && !created) {
+		xasprintf(&tmp, "%s.XXXXXXXXXX", path);
+		if ((fd = mkstemp(tmp)) == -1) {
+			logit("%s unavailable: mkstemp %s: %s", what, tmp,
+			    strerror(errno));
+			free(tmp);
+			free(id);
+			return -1;
+		}
+		snprintf(owner, sizeof(owner), "%*ld", SHFILE_OWNER_LEN,
+		    (long)getpid());
+		if (atomicio(vwrite, fd, (void *)ip, idlen) != idlen ||
+		    atomicio(vwrite, fd, owner, SHFILE_OWNER_LEN) !=
+		    SHFILE_OWNER_LEN ||
+		    atomicio(vwrite, fd, (void *)(ip + idlen +
+		    SHFILE_OWNER_LEN), rest) != rest ||
+		    rename(tmp, path) == -1) {
+			logit("%s unavailable: %s: %s", what, path,
+			    strerror(errno));
+			unlink(tmp);
+			free(tmp);
+			free(id);
+			close(fd);
+			return -1;
+		}
+		free(tmp);
+		close(fd);
+		/* Open it again, so that the mapping cannot gain access */
+		created = 1;
+		goto again;
+	}
+	free(id);
+	if (fd == -1) {
+		logit("%s unavailable: %s changed while being set up", what,
+		    path);
+		return -1;
+	}
+	*stp = st;
+	return fd;
+}
+
+/*
+ * Open the file at path again with flags, for an update. Fails quietly
+ * where the file cannot be opened, as in an unprivileged child, and where
+ * it has been replaced since shfile_open() set it up as dev/ino.
+ */
+int
+shfile_reopen(const char *path, dev_t dev, ino_t ino, int flags)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, flags|O_NOFOLLOW)) == -1) {
+		debug3("%s: open %s: %s", __func__, path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || st.st_dev != dev || st.st_ino != ino) {
+		debug3("%s: %s has been replaced", __func__, path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * As shfile_open(), but map the file shared and read-only, in a way that
+ * cannot be undone. Returns NULL if the file cannot be used.
+ */
+void *
+shfile_map(const char *path, const void *init, size_t len, size_t idlen,
+    struct stat *stp, const char *what)
+{
+#if defined(HAVE_MMAP) && defined(MAP_SHARED)
+	void *p;
+	int fd;
+
+	if ((fd = shfile_open(path, init, len, idlen, stp, what)) == -1)
+		return NULL;
+	p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, (off_t)0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		logit("%s unavailable: mmap %s: %s", what, path,
+		    strerror(errno));
+		return NULL;
+	}
+	return p;
+#else
+	logit("%s unavailable: no shared file mappings", what);
+	return NULL;
+#endif
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SHFILE_H
+#define _SHFILE_H
+
+/*
+ * Each shared file records, after the bytes identifying its layout, the
+ * pid of the process that created it, as text so that a text file stays
+ * readable.
+ */
+#define SHFILE_OWNER_LEN	12
+
+int	 shfile_open(const char *, const void *, size_t, size_t,
+	    struct stat *, const char *);
+int	 shfile_reopen(const char *, dev_t, ino_t, int);
+void	*shfile_map(const char *, const void *, size_t, size_t,
+	    struct stat *, const char *);
+
+#endif /* _SHFILE_H */
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "buffer.h"
+#include "shfile.h"
+#include "shcache.h"
+#include "statsfile.h"
+
+/*
+ * Statistics, kept as text in the file named by StatisticsFile so that
+ * they can be read at any time, with cat(1) for instance. Every process
+ * that parses the configuration maps the file, re-executed children
+ * included, so the counts cover every connection since the file was
+ * started. Each count is a fixed-width decimal field. As with the file
+ * caches, the mapping is read-only and a count is updated by writing to
+ * the file, which only a process with the privileges of its owner can
+ * open: under privilege separation, the monitor, never the unprivileged
+ * child. Updates take no lock, so the counts are advisory and may lose an
+ * update when two processes race.
+ *
+ * The first line identifies the configuration and the layout of the rest,
+ * and the process that created the file. A process that parses a different
+ * configuration replaces the file with a fresh one, unless its creator is
+ * still running (see shfile_open()); processes still using the old one keep
+ * counting into it unseen, rather than into a layout they do not know.
+ */
+#define STATS_FIELD_LEN		20
+
+static char *stats_map = NULL;	/* the text after the first line */
+static size_t stats_maplen = 0, stats_skip = 0;
+static char *stats_path = NULL;
+static dev_t stats_dev;
+static ino_t stats_ino;
+static int stats_fd = -1;	/* open between stats_begin() and stats_end() */
+
+void
+stats_close(void)
+{
+	if (stats_map == NULL)
+		return;
+#if defined(HAVE_MMAP) && defined(MAP_SHARED)
+	if (munmap(stats_map - stats_skip, stats_maplen) == -1)
+		error("%s: munmap: %s", __func__, strerror(errno));
+#endif
+	free(stats_path);
+	stats_path = NULL;
+	stats_map = NULL;
+	stats_maplen = stats_skip = 0;
+}
+
+/*
+ * Append a labelled count of zero to the text a statistics file starts
+ * from, returning the offset of the count for stats_add().
+ */
+size_t
+stats_field(Buffer *b, const char *label)
+{
+	char field[STATS_FIELD_LEN + 1];
+	size_t off;
+
+	buffer_append(b, " ", 1);
+	buffer_append(b, label, strlen(label));
+	buffer_append(b, " ", 1);
+	off = buffer_len(b);
+	snprintf(field, sizeof(field), "%*d", STATS_FIELD_LEN, 0);
+	buffer_append(b, field, STATS_FIELD_LEN);
+	return off;
+}
+
+/*
+ * Open the statistics file for the stats_add() calls up to stats_end().
+ * Fails quietly where the file cannot be opened for writing, as in an
+ * unprivileged child, and where it has been replaced since it was mapped;
+ * the counts are then left alone. The descriptor is never kept beyond
+ * stats_end(), so that no child forked later inherits it.
+ */
+void
+stats_begin(void)
+{
+	if (stats_map == NULL || stats_fd != -1)
+		return;
+	stats_fd = shfile_reopen(stats_path, stats_dev, stats_ino, O_WRONLY);
+}
+
+void
+stats_end(void)
+{
+	if (stats_fd == -1)
+		return;
+	close(stats_fd);
+	stats_fd = -1;
+}
+
+void
+stats_add(size_t off, u_int64_t n)
+{
+	char field[STATS_FIELD_LEN + 1];
+	unsigned long long v;
+
+	if (stats_fd == -1 || n == 0)
+		return;
+	memcpy(field, stats_map + off, STATS_FIELD_LEN);
+	field[STATS_FIELD_LEN] = '\0';
+	v = strtoull(field, NULL, 10) + n;
+	snprintf(field, sizeof(field), "%*llu", STATS_FIELD_LEN, v);
+	if (pwrite(stats_fd, field, STATS_FIELD_LEN,
+	    (off_t)(stats_skip + off)) != STATS_FIELD_LEN)
+		debug3("%s: write %s: %s", __func__, stats_path,
+		    strerror(errno));
+}
+
+/*
+ * Map the statistics file at path, which holds the text in body once
+ * counting starts. conf identifies the configuration. Returns -1 if the
+ * file cannot be used.
+ */
+int
+stats_open(const char *path, Buffer *body, Buffer *conf)
+{
+	Buffer init;
+	char head[64];
+	struct stat st;
+	size_t hlen;
+	void *p;
+
+	stats_close();
+	hlen = snprintf(head, sizeof(head), "# sshd statistics %08x %08x "
+	    "owner", fnv1a(FNV1A_INIT, buffer_ptr(conf), buffer_len(conf)),
+	    fnv1a(FNV1A_INIT, buffer_ptr(body), buffer_len(body)));
+	buffer_init(&init);
+	buffer_append(&init, head, hlen);
+	/* shfile_map() fills in the owner */
+	buffer_append_space(&init, SHFILE_OWNER_LEN);
+	buffer_append(&init, "\n", 1);
+	buffer_append(&init, buffer_ptr(body), buffer_len(body));
+	p = shfile_map(path, buffer_ptr(&init), buffer_len(&init), hlen,
+	    &st, "Statistics");
+	if (p != NULL) {
+		stats_skip = hlen + SHFILE_OWNER_LEN + 1;
+		stats_map = (char *)p + stats_skip;
+		stats_maplen = buffer_len(&init);
+		stats_path = xstrdup(path);
+		stats_dev = st.st_dev;
+		stats_ino = st.st_ino;
+	}
+	buffer_free(&init);
+	return p != NULL ? 0 : -1;
+}